@@ -1,4 +1,6 @@
+#pragma once
 #include <filesystem>
+#include <string>
 #include <vector>
 #include <variant>
 
@@ -7,18 +9,64 @@
 // space. Only one dimension may shrink, as the other one fixes the scale.
 enum class Shrink { None, Width, Height };
 
+// Filter the photo is resized with, from the quickest to the sharpest, chosen by
+// --resample. Lanczos is what hiframe always used, and remains the default.
+enum class Resample { Fast, Balanced, Lanczos };
+
+// What becomes of the EXIF thumbnail of the input, chosen by --thumbnail: it
+// shows the photo before framing, and is carried over as it is by default.
+enum class Thumbnail { Keep, Strip, Regenerate };
+
+// How an UltraHDR output trades encoding time and file size against fidelity,
+// chosen by --hdr-tier: from quick previews to the smallest archived files.
+enum class HdrTier { Realtime, Balanced, Archival };
+
 struct CLIArgs
 {
     int quality;   // JPEG quality, 90 by default
     // List of files to process, each file is a pair of (input,output)
     std::vector<std::pair<std::filesystem::path,std::filesystem::path>> files;
+    std::string outputPattern; // names the output of an input, default: framed/{}
+    // directory whose new photos are framed as they arrive, instead of the
+    // files above, default: none
+    std::filesystem::path watch;
     int width, height; // size of the output, default: 1080×1350~
     Shrink shrink; // dimension marked with `~` in --size, default: none
     int fontsize; // font size of the main text, default: 26; the sub text and
                   // every other length in the frame scale along with it
     int margin; // width of the white frame, default: 0
+    Resample resample; // filter the photo is resized with, default: lanczos
+    HdrTier hdrTier; // encoding of an UltraHDR output, default: balanced
+    // copy the compressed photo into the output when it needs no resizing,
+    // rather than decode it and compress it again, default: false
+    bool copyPhoto;
+    Thumbnail thumbnail; // EXIF thumbnail of the output, default: keep
+    bool stripMakerNotes; // drop the maker notes from the EXIF data, default: false
+    // directory keeping decoded and resized photos for later runs, default:
+    // none, no cache
+    std::filesystem::path cache;
+    // free the buffers of a file once done with them, rather than keep them
+    // for the next one, default: false
+    bool lowMemory;
+    int threads; // threads of the whole run, default: 0, one per core
+    // --shard i/N: frame only the inputs falling to shard i of N, numbered
+    // from 1, default: 1/1, every input
+    int shardIndex, shardCount;
+    // file listing every input framed or failed, see Manifest, default: none
+    std::filesystem::path manifest;
+    // manifests to combine, checking the inputs against them, instead of
+    // framing anything, default: none
+    std::vector<std::filesystem::path> merge;
+    // print the layout of each output, computed from the headers and the
+    // EXIF data of its input, instead of framing anything, default: false
+    bool plan;
 
     bool verbose;
 };
 
 std::variant<CLIArgs,int> parse_arguments(int argc, char **argv);
+
+// Path of the output of `input`: the file name given by `pattern`, in which {}
+// stands for the name of the input without extension, in the directory of the
+// input, or relative to it. Throws std::format_error if the pattern is wrong.
+std::filesystem::path format_output(const std::filesystem::path &input, const std::string &pattern);
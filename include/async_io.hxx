@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Reads the inputs of a batch ahead of the workers, and writes their outputs
+// behind them, so that a worker spends its time on pixels rather than waiting
+// for the disk, or the network. The I/O goes through io_uring where the kernel
+// offers it, and through a few threads of its own otherwise.
+class AsyncIO {
+public:
+    struct State;
+
+    // Read `inputs` in order, keeping up to `depth` of them read ahead of the
+    // one last asked for.
+    AsyncIO(std::vector<std::filesystem::path> inputs, std::size_t depth);
+    // Waits for the outputs still being written.
+    ~AsyncIO();
+    AsyncIO(const AsyncIO&) = delete;
+    AsyncIO& operator=(const AsyncIO&) = delete;
+
+    // Content of inputs[i], waiting for it if it is not read yet. Nothing if it
+    // cannot be read, the reason being reported on stderr.
+    std::optional<std::vector<char>> read(std::size_t i);
+    // Hand back a buffer returned by read(), for a later input to be read into.
+    void recycle(std::vector<char> buffer);
+
+    // Write `data` to `file`, replacing it, in the background. A failure is
+    // reported on stderr once it happens. `written`, if any, is then told
+    // whether the file was written, from another thread.
+    void write(std::filesystem::path file, std::vector<char> data, std::function<void(bool)> written = {});
+    // Wait for every output to be written; returns whether all of them were.
+    bool flush();
+
+    // Name of the mechanism in use, for the curious
+    const char *backend() const;
+
+private:
+    std::unique_ptr<State> state;
+};
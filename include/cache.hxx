@@ -0,0 +1,40 @@
+#pragma once
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <ultrahdr_api.h>
+
+#include "arguments.hxx"
+
+// The photo of an input, decoded and resized to the size it takes in the frame,
+// with everything the encoder needs to reproduce its HDR rendition.
+struct PhotoPlanes {
+    cv::Mat sdr; // BGR, 8 bits
+    cv::Mat hdr; // BGR linear, 32-bit float once decoded, half float if the
+                 // cache is on; empty for an SDR photo
+    // Color space the pixels are in, sRGB unless the input is tagged otherwise
+    uhdr_color_gamut_t colorGamut = UHDR_CG_BT_709;
+    // Gain map of the input, if it has one, and whether it has one channel per
+    // color, which is what the encoder writes unless told otherwise
+    std::optional<uhdr_gainmap_metadata_t> gainmap;
+    bool multiChannelGainmap = true;
+    // Memory `sdr` and `hdr` point into when they are mapped from the cache
+    std::shared_ptr<const void> storage;
+};
+
+// File name of the cache entry of the photo in `input`, resized to `photo` with
+// `mode`. Any change to the content of the input names a different entry, so
+// an entry is never out of date, and never needs to be rewritten.
+std::string cache_key(const std::vector<char> &input, cv::Size photo, Resample mode);
+
+// The planes stored in `file`, mapped into memory rather than read. Nothing if
+// there is no such entry, or if it was written by an incompatible hiframe.
+std::optional<PhotoPlanes> load_planes(const std::filesystem::path &file);
+
+// Store `planes` in `file`; returns whether it succeeded. The entry appears at
+// once, complete, so that concurrent runs may share the cache.
+bool store_planes(const std::filesystem::path &file, const PhotoPlanes &planes);
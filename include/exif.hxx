@@ -12,9 +12,48 @@ struct Metadata {
     // When the photo was taken, in UTC, unset if it carries no date. A photo
     // without a time zone is taken to be in UTC.
     std::optional<std::chrono::sys_seconds> taken;
+    // EXIF orientation, 1 for a photo stored upright, or carrying no such tag
+    int orientation = 1;
 };
 
 Metadata parseExif(const Exiv2::ExifData &exifData);
+// Metadata of the JPEG photo in `buf`, read from its EXIF segment in a single
+// pass over the few tags the frame shows, rather than by Exiv2, which decodes
+// every tag, maker notes included. Nothing if the photo has no EXIF segment,
+// or one that is not TIFF, in which case parseExif(getExif(buf)) still finds
+// what it can.
+std::optional<Metadata> readExif(const std::vector<char> &buf);
 Exiv2::ExifData getExif(const std::vector<char> &buf);
-// ICC profile of the image, empty if it does not carry one
+
+// The EXIF segment of a JPEG photo, carried over to the output byte for byte,
+// maker notes and thumbnail included, but for the tags describing the image,
+// which are patched in place. Unlike Exiv2, it decodes none of the tags.
+class ExifSegment {
+    std::vector<uint8_t> segment; // "Exif\0\0", then the TIFF structure
+    bool little;                  // byte order of the TIFF structure
+    // Position in the segment of the value of a tag of IFD0, 0 if it has none
+    // or one that is not a single SHORT or LONG, and its type
+    struct Field {
+        size_t position = 0;
+        unsigned type = 0;
+    };
+    Field orientation, width, height;
+
+public:
+    // The EXIF segment of the JPEG in `buf`; nothing if it has none, or one
+    // that is not TIFF.
+    static std::optional<ExifSegment> read(const std::vector<char> &buf);
+    // Mark the image upright, as it is once decoded, and `width` by `height`,
+    // where the segment says either.
+    void patch(int width, int height);
+    // The content of the APP1 segment
+    const std::vector<uint8_t> &bytes() const { return segment; }
+};
+
+// Remove the maker notes from `exifData`: the MakerNote tag, and every tag
+// Exiv2 decoded out of it. They run to tens of kilobytes for some cameras, and
+// tell nothing about the framed photo.
+void pruneMakerNotes(Exiv2::ExifData &exifData);
+// ICC profile of the JPEG image, empty if it does not carry one, or only part
+// of it
 std::vector<uint8_t> getIcc(const std::vector<char> &buf);
@@ -1,6 +1,8 @@
 #pragma once
+#include <cstdint>
 #include <filesystem>
 #include <system_error>
+#include <vector>
 
 // Executable directory
 std::filesystem::path get_executable_directory();
@@ -8,3 +10,11 @@ std::filesystem::path get_executable_directory();
 // Create the directory holding `file`, together with any missing parent, unless
 // it already exists. Returns the reason of the failure, if any.
 std::error_code create_parent_directory(const std::filesystem::path &file);
+
+// Read the whole of `file` into `data`, or its first `limit` bytes if it is
+// longer. Returns the reason of the failure, if any.
+std::error_code read_file(const std::filesystem::path &file, std::vector<char> &data,
+                          size_t limit = SIZE_MAX);
+// Write `data` to `file`, replacing it. Returns the reason of the failure, if
+// any.
+std::error_code write_file(const std::filesystem::path &file, const std::vector<char> &data);
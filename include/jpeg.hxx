@@ -0,0 +1,62 @@
+#pragma once
+#include <vector>
+#include <optional>
+#include <memory>
+
+#include <opencv2/core.hpp>
+
+// Size of the JPEG image in `buf`, as stored, that is, before any EXIF
+// orientation is applied, read from its frame header without decoding it.
+// Nothing if no frame header is found.
+std::optional<cv::Size> jpeg_size(const std::vector<char> &buf);
+
+// Whether the JPEG in `buf` may be an UltraHDR image, told from the markers of
+// its segments alone. A plain photo is thus spared the libultrahdr decoder that
+// is_uhdr_image() sets up to tell it.
+bool may_be_uhdr(const std::vector<char> &buf);
+
+// Compress `image`, BGR, into the baseline JPEG `out`, as imencode does at
+// `quality`, but over the threads OpenCV is given: the image is cut into
+// strips of whole rows of MCUs, compressed in parallel, then joined by restart
+// markers, one after every row of MCUs. The pixels come out as from a single
+// libjpeg pass. False if libjpeg fails, the reason being reported on stderr.
+bool encode_jpeg(const cv::Mat &image, int quality, std::vector<uchar> &out);
+
+// Insert the APP1 segment `exif`, signature included, and the ICC profile
+// `icc`, cut into APP2 segments, into the headers of the JPEG `jpeg`, which
+// has neither. Either is left out if empty, or too large for a JPEG, which is
+// reported on stderr and makes it false.
+bool insert_metadata(std::vector<uchar> &jpeg, const std::vector<uint8_t> &exif, const std::vector<uint8_t> &icc);
+
+// A JPEG photo kept as its quantized DCT coefficients, to be set into a larger
+// picture without being decoded and compressed again, the way jpegtran crops
+// and rotates: the blocks of the photo are copied, and only those of the
+// picture around it are compressed, with the quantization tables of the photo.
+class DctPhoto {
+    struct Codec;
+    std::unique_ptr<Codec> codec;
+
+    explicit DctPhoto(std::unique_ptr<Codec> codec);
+
+public:
+    // Read the headers of the JPEG in `buf`, which must outlive the object.
+    // Nothing if libjpeg cannot read them, or if the photo is not YCbCr, the
+    // color space a BGR canvas converts to; a grayscale one would leave the
+    // frame around it gray too.
+    static std::optional<DctPhoto> open(const std::vector<char> &buf);
+    DctPhoto(DctPhoto&&) noexcept;
+    DctPhoto &operator=(DctPhoto&&) noexcept;
+    ~DctPhoto();
+
+    // Size of the photo, as stored
+    cv::Size size() const;
+    // Unit of the positions the photo can be set at, so that its blocks line
+    // up with those of the picture
+    cv::Size mcu() const;
+
+    // Compress `canvas`, a BGR picture, into the JPEG `out`, with the photo at
+    // `at`, a multiple of mcu(), in place of whatever lies there. Blocks
+    // astride the edge of the photo are decoded and compressed again, unless
+    // the photo reaches the edge of the canvas there. Can be done once only.
+    bool compose(const cv::Mat &canvas, cv::Point at, std::vector<uchar> &out);
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+// Bytes of image data held while processing one file, and the most held at
+// once. Every Mat allocated by a thread while a meter is installed on it by
+// MeterScope is counted, until it is freed, whichever thread frees it; other
+// buffers are counted by hand with track() and untrack(). The working memory
+// of the libraries hiframe calls into, the decoders among them, is not.
+class MemoryMeter {
+    std::atomic<std::size_t> current = 0, highest = 0;
+
+public:
+    void track(std::size_t bytes);
+    void untrack(std::size_t bytes);
+    std::size_t peak() const { return highest; }
+};
+
+// Install `meter` on the calling thread for the lifetime of the scope; none at
+// all if it is null.
+class MeterScope {
+    MemoryMeter *previous;
+
+public:
+    explicit MeterScope(MemoryMeter *meter);
+    ~MeterScope();
+    MeterScope(const MeterScope&) = delete;
+    MeterScope& operator=(const MeterScope&) = delete;
+};
+
+// Make every Mat allocation visible to the meters. Called once, before any
+// thread is started.
+void install_metered_allocator();
+
+// Full-size buffers kept across the files of a worker, since consecutive files
+// of a batch mostly come out at the same size: a canvas taken from the pool
+// reuses the memory of the one a previous file gave back, rather than paying
+// for the allocation, and for the page faults of first touching it, again.
+// The content of a taken Mat is whatever was left in it.
+class MatPool {
+    std::vector<cv::Mat> idle;
+
+public:
+    // A Mat of `rows` by `cols` of `type`, counted by `meter` until given back
+    cv::Mat take(int rows, int cols, int type, MemoryMeter &meter);
+    // Return `mat`, taken from this pool, to it, or free it if something else
+    // still refers to it. `mat` is left empty.
+    void give(cv::Mat &mat, MemoryMeter &meter);
+};
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+
+// How the threads of a run are shared out: `workers` files are processed at
+// once, and OpenCV, as well as the loops of hiframe itself, spread the work on
+// each of them over `intra` threads.
+struct ThreadBudget {
+    int workers; // files processed at once
+    int intra;   // threads working on each of those files
+};
+
+// Split `threads` threads, 0 meaning one per core, over a run of `files` files.
+// Files are independent, hence the cheapest to run in parallel; a run of fewer
+// files than threads hands the spare threads to each file instead, so that a
+// single photo gets the whole machine.
+ThreadBudget plan_threads(int threads, std::size_t files);
+
+// Configure the thread pool of OpenCV for the budget. It has to be called before
+// any file is processed, as the pool is shared by all of them.
+void apply_thread_budget(const ThreadBudget &budget);
+
+// Call job(i) for every i in [0, count), from `workers` threads at once. The
+// calls are spread dynamically, so a slow file does not hold up the others.
+void run_parallel(std::size_t count, int workers, const std::function<void(std::size_t)> &job);
@@ -0,0 +1,38 @@
+#pragma once
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+// Whether `input` falls to shard `index` of `count`, numbered from 1. Every
+// input falls to exactly one shard, decided by a hash of its path alone, so
+// that machines given the same inputs and the same count split them between
+// themselves with nothing to agree on but the command line. The path is taken
+// as written, save for `.` and `..` components, so the inputs must be named
+// alike on every machine, e.g. relative to a shared directory.
+bool in_shard(const std::filesystem::path &input, int index, int count);
+
+// List of the inputs a run framed, or failed to, one line each, as they are
+// done: the input, its output, `ok` or `failed`, and the milliseconds taken,
+// separated by tabs, after a header line. A tab, newline or backslash in a
+// path is escaped as \t, \n or \\.
+class Manifest {
+    std::ofstream file;
+    std::mutex mutex;
+
+public:
+    // Start the manifest in `path`, replacing any; false if it cannot be
+    // written, the reason being reported on stderr.
+    bool open(const std::filesystem::path &path);
+    // Add the outcome of an input, from any thread
+    void record(const std::filesystem::path &input, const std::filesystem::path &output, bool framed,
+                double milliseconds);
+};
+
+// Combine `manifests`, of the shards of a run, into one on stdout, and report
+// on stderr which of `inputs` are missing from them, and which inputs failed.
+// An input framed according to any of the manifests counts as framed. Returns
+// the exit status: 0 if every input was framed, 1 otherwise, 2 if a manifest
+// cannot be read.
+int merge_manifests(const std::vector<std::filesystem::path> &manifests,
+                    const std::vector<std::filesystem::path> &inputs);
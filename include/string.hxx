@@ -2,6 +2,7 @@
 
 #include <iterator>
 #include <string>
+#include <string_view>
 #include <cstdint>
 #include <chrono>
 #include <optional>
@@ -11,6 +12,14 @@
 // are written this way.
 std::optional<std::chrono::sys_seconds> parse_datetime(const std::string &datetime);
 
+// `text` as a JSON string, quotes included. The text is taken to be UTF-8, and
+// is passed through but for the characters JSON requires to be escaped.
+std::string json_string(const std::string &text);
+
+// 64-bit FNV-1a of `data`: stable across machines and builds, unlike std::hash,
+// and enough to tell inputs apart, though not to resist forgery.
+uint64_t fnv1a(std::string_view data);
+
 // UTF-8 iterator
 class utf8_iterator {
 public:
@@ -5,7 +5,7 @@
 #include <string>
 #include <string_view>
 
-#include <opencv2/opencv.hpp>
+#include <opencv2/core.hpp>
 #include <ft2build.h>
 #include <freetype/freetype.h>
 
@@ -17,6 +17,8 @@ public:
     TextRenderer(std::initializer_list<std::string_view> fontPaths, int fontSize);
     ~TextRenderer();
 
+    // Draw `text` with its baseline starting at `pos` onto `img`, BGR, 8-bit or
+    // float, or BGRA with straight alpha, which the text is laid over.
     void render(cv::Mat& img, const std::string& text, cv::Point pos, cv::Scalar color);
     int width(const std::string& text);
 };
@@ -0,0 +1,11 @@
+#pragma once
+#include <filesystem>
+#include <functional>
+
+// Call arrived(photo) for every JPEG photo that lands in `dir`, whether written
+// there or moved in, once it is complete. A file is taken to be complete once
+// it was closed after writing, and left alone for a short while since, which
+// lets a writer closing and reopening it settle first, and if it ends like a
+// JPEG does. Runs until the directory cannot be watched any more; returns the
+// exit status of the program then.
+int watch_directory(const std::filesystem::path &dir, const std::function<void(const std::filesystem::path&)> &arrived);
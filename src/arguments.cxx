@@ -2,6 +2,7 @@
 #include <iostream>
 #include <cstdlib>
 #include <cctype>
+#include <cstdio>
 #include <format>
 #include <algorithm>
 #include <stdexcept>
@@ -42,7 +43,8 @@ fs::path format_output(const fs::path &input, const string &pattern) {
 
 std::variant<CLIArgs,int> parse_arguments(int argc, char **argv) {
     CLIArgs args;
-    string output_file, output_pattern, image_size;
+    string output_file, output_pattern, image_size, resample, hdr_tier, thumbnail, cache_dir, watch_dir, shard, manifest;
+    vector<string> merge;
 
     po::positional_options_description op_positional;
     op_positional.add("input", -1);
@@ -50,7 +52,13 @@ std::variant<CLIArgs,int> parse_arguments(int argc, char **argv) {
     po::options_description op_basic("Options");
     op_basic.add_options()
         ("output,o", po::value<string>(&output_file), "output file")
-        ("output-pattern,O", po::value<string>(&output_pattern)->default_value("framed/{}"), "pattern of output files");
+        ("output-pattern,O", po::value<string>(&output_pattern)->default_value("framed/{}"), "pattern of output files")
+        ("watch,w", po::value<string>(&watch_dir), "frame new photos in a directory as they arrive")
+        ("shard", po::value<string>(&shard)->default_value("1/1"), "frame only shard i/N of the inputs")
+        ("manifest", po::value<string>(&manifest), "list the inputs framed or failed in a file")
+        ("merge", po::value<vector<string>>(&merge)->composing(),
+                  "combine manifests, repeated once each, and check the inputs against them")
+        ("plan", po::bool_switch(&args.plan), "print the layout of each output as JSON, without framing anything");
 
     po::options_description op_image("Image Options");
     op_image.add_options()
@@ -58,12 +66,23 @@ std::variant<CLIArgs,int> parse_arguments(int argc, char **argv) {
                    "size; a dimension suffixed with ~ shrinks to the photo")
         ("quality,q", po::value<int>(&args.quality)->default_value(90), "quality")
         ("font-size,f", po::value<int>(&args.fontsize)->default_value(26), "font size")
-        ("margin,m",po::value<int>(&args.margin)->default_value(0), "frame margin");
+        ("margin,m",po::value<int>(&args.margin)->default_value(0), "frame margin")
+        ("resample,r", po::value<string>(&resample)->default_value("lanczos"),
+                       "resampling filter: fast, balanced or lanczos")
+        ("hdr-tier", po::value<string>(&hdr_tier)->default_value("balanced"),
+                     "UltraHDR encoding: realtime, balanced or archival, from the quickest to the smallest")
+        ("copy-photo", po::bool_switch(&args.copyPhoto), "copy a photo needing no resizing as is, without compressing it again")
+        ("thumbnail", po::value<string>(&thumbnail)->default_value("keep"),
+                      "EXIF thumbnail: keep that of the photo, strip it, or regenerate it from the output")
+        ("strip-maker-notes", po::bool_switch(&args.stripMakerNotes), "drop the maker notes from the EXIF data");
 
     po::options_description op_other("Other Options");
     op_other.add_options()
         ("help", "display this help")
         ("version", "output version information")
+        ("cache", po::value<string>(&cache_dir), "directory caching resized photos across runs")
+        ("low-memory", po::bool_switch(&args.lowMemory), "free buffers after each file, rather than reuse them")
+        ("threads,j", po::value<int>(&args.threads)->default_value(0), "number of threads, 0 for one per core")
         ("verbose", po::value<bool>(&args.verbose)->default_value(false), "increase verbosity");
 
     po::options_description hidden_options("");
@@ -79,6 +98,8 @@ std::variant<CLIArgs,int> parse_arguments(int argc, char **argv) {
         clog << "Usage: " << argv[0] << " <input> -o <output>\n";
         clog << "       " << argv[0] << " <input>\n";
         clog << "       " << argv[0] << " <input>.. -O <output pattern>\n";
+        clog << "       " << argv[0] << " --watch <directory> -O <output pattern>\n";
+        clog << "       " << argv[0] << " --merge <manifest>... [<input>..]\n";
         clog << visible_options << endl;
         return x;
     };
@@ -91,26 +112,56 @@ std::variant<CLIArgs,int> parse_arguments(int argc, char **argv) {
     if(vm.contains("help"))
         return help(0);
 
+    // Paths are taken as strings, which unlike a std::filesystem::path read
+    // by Boost may hold spaces
+    args.cache = cache_dir;
+    args.watch = watch_dir;
+    args.manifest = manifest;
+    args.merge.assign(merge.begin(), merge.end());
+
     // parse file option
-    if (!vm.contains("input"))
-        return help(2);
-    auto &inputs = vm["input"].as<vector<string>>();
+    args.outputPattern = output_pattern;
     try {
-        switch (inputs.size())
-        {
-        case 0: return help(2);
-        case 1:
-            if(output_file != "")
-                args.files.emplace_back(inputs[0], output_file);
-            else
-                args.files.emplace_back(inputs[0], format_output(inputs[0], output_pattern));
-            break;
-        default:
-            if(output_file != "")
+        if (!args.merge.empty()) {
+            // The inputs are only checked against the manifests
+            if (!args.watch.empty()) {
+                clog << "--merge and --watch exclude each other\n\n";
                 return help(2);
-
-            for (auto &input: vm["input"].as<vector<string>>())
-                args.files.emplace_back(input, format_output(input, output_pattern));
+            }
+            if (vm.contains("input"))
+                for (auto &input: vm["input"].as<vector<string>>())
+                    args.files.emplace_back(input, fs::path());
+        } else if (!args.watch.empty()) {
+            if (args.plan) {
+                clog << "--plan and --watch exclude each other\n\n";
+                return help(2);
+            }
+            if (vm.contains("input") || output_file != "") {
+                clog << "--watch takes neither input files nor --output\n\n";
+                return help(2);
+            }
+            // The photos are yet to come, but the pattern can be checked now
+            format_output("photo.jpg", output_pattern);
+        } else {
+            if (!vm.contains("input"))
+                return help(2);
+            auto &inputs = vm["input"].as<vector<string>>();
+            switch (inputs.size())
+            {
+            case 0: return help(2);
+            case 1:
+                if(output_file != "")
+                    args.files.emplace_back(inputs[0], output_file);
+                else
+                    args.files.emplace_back(inputs[0], format_output(inputs[0], output_pattern));
+                break;
+            default:
+                if(output_file != "")
+                    return help(2);
+
+                for (auto &input: vm["input"].as<vector<string>>())
+                    args.files.emplace_back(input, format_output(input, output_pattern));
+            }
         }
     } catch (const std::format_error &e) {
         // std::format rejects unbalanced braces, and accepts {} only once
@@ -158,5 +209,46 @@ std::variant<CLIArgs,int> parse_arguments(int argc, char **argv) {
         return help(2);
     }
 
+    if (resample == "fast") args.resample = Resample::Fast;
+    else if (resample == "balanced") args.resample = Resample::Balanced;
+    else if (resample == "lanczos") args.resample = Resample::Lanczos;
+    else {
+        clog << "Wrong --resample, expect fast, balanced or lanczos\n\n";
+        return help(2);
+    }
+
+    // parse shard
+    {
+        int index = 0, count = 0, length = 0;
+        if (sscanf(shard.c_str(), "%d/%d%n", &index, &count, &length) != 2 || length != (int)shard.size() ||
+            count < 1 || index < 1 || index > count) {
+            clog << "Wrong --shard, expect i/N, with 1 ≤ i ≤ N\n\n";
+            return help(2);
+        }
+        args.shardIndex = index;
+        args.shardCount = count;
+    }
+
+    if (hdr_tier == "realtime") args.hdrTier = HdrTier::Realtime;
+    else if (hdr_tier == "balanced") args.hdrTier = HdrTier::Balanced;
+    else if (hdr_tier == "archival") args.hdrTier = HdrTier::Archival;
+    else {
+        clog << "Wrong --hdr-tier, expect realtime, balanced or archival\n\n";
+        return help(2);
+    }
+
+    if (thumbnail == "keep") args.thumbnail = Thumbnail::Keep;
+    else if (thumbnail == "strip") args.thumbnail = Thumbnail::Strip;
+    else if (thumbnail == "regenerate") args.thumbnail = Thumbnail::Regenerate;
+    else {
+        clog << "Wrong --thumbnail, expect keep, strip or regenerate\n\n";
+        return help(2);
+    }
+
+    if (args.threads < 0) {
+        clog << "Wrong --threads, expect a non-negative integer\n\n";
+        return help(2);
+    }
+
     return args;
 }
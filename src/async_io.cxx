@@ -0,0 +1,440 @@
+// async_io.cxx
+// Copyright (c) 2025, 张子辰
+
+// This file is part of HDR Image Frame.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "async_io.hxx"
+
+using std::vector, std::cerr, std::endl;
+namespace fs = std::filesystem;
+
+namespace {
+
+// A file to read whole, or to write whole
+struct Job {
+    bool write;
+    fs::path path;
+    vector<char> data;
+    std::size_t input = 0; // index of the input read
+    int fd = -1;
+    std::size_t done = 0;  // bytes transferred so far
+    int error = 0;         // errno of the failure, if any
+    std::function<void(bool)> written = {}; // told the outcome of a write
+};
+
+// Open the file of `job` and, for a read, size its buffer to the file. This is
+// the blocking part of a job that io_uring does not take over.
+bool openJob(Job &job) {
+    job.fd = job.write ? open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)
+                       : open(job.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (job.fd < 0) { job.error = errno; return false; }
+    if (!job.write) {
+        struct stat st;
+        if (fstat(job.fd, &st) != 0) { job.error = errno; return false; }
+        job.data.resize(st.st_size);
+    }
+    return true;
+}
+
+void closeJob(Job &job) {
+    if (job.fd >= 0 && close(job.fd) != 0 && !job.error && job.write) job.error = errno;
+    job.fd = -1;
+}
+
+// Carries out jobs, calling back once each of them is over, from a thread of
+// its own. Calls back without holding any lock of its own, so that the callback
+// may submit further jobs.
+class Executor {
+public:
+    using Done = std::function<void(Job*)>;
+    virtual ~Executor() = default;
+    virtual void submit(Job *job) = 0;
+    virtual const char *name() const = 0;
+};
+
+// A few threads doing blocking reads and writes, for kernels without io_uring
+class ThreadExecutor : public Executor {
+    Done finished;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Job*> queue;
+    bool stopping = false;
+    vector<std::thread> threads;
+
+    void run() {
+        for (;;) {
+            Job *job;
+            {
+                std::unique_lock lock(mutex);
+                ready.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                job = queue.front();
+                queue.pop_front();
+            }
+
+            if (openJob(*job)) {
+                while (job->done < job->data.size()) {
+                    auto n = job->write ? ::write(job->fd, job->data.data() + job->done, job->data.size() - job->done)
+                                        : ::read(job->fd, job->data.data() + job->done, job->data.size() - job->done);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) { job->error = n < 0 ? errno : EIO; break; }
+                    job->done += n;
+                }
+            }
+            closeJob(*job);
+            finished(job);
+        }
+    }
+
+public:
+    ThreadExecutor(Done finished, int count) : finished(std::move(finished)) {
+        for (int i = 0; i < count; i++) threads.emplace_back([this] { run(); });
+    }
+
+    ~ThreadExecutor() override {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto &thread : threads) thread.join();
+    }
+
+    void submit(Job *job) override {
+        {
+            std::lock_guard lock(mutex);
+            queue.push_back(job);
+        }
+        ready.notify_one();
+    }
+
+    const char *name() const override { return "threads"; }
+};
+
+// io_uring, driven by one thread through the raw system calls. The thread
+// blocks in io_uring_enter() until a transfer completes, or until an eventfd
+// polled through the ring signals that new jobs were submitted.
+class UringExecutor : public Executor {
+    static constexpr unsigned ENTRIES = 64;
+    static constexpr uint64_t WAKE = 0; // user data of the poll of the eventfd
+
+    Done finished;
+    int ring = -1, wake = -1;
+    void *sqRing = MAP_FAILED, *cqRing = MAP_FAILED;
+    std::size_t sqRingSize = 0, cqRingSize = 0;
+    io_uring_sqe *sqes = (io_uring_sqe*)MAP_FAILED;
+    unsigned *sqTail, *sqMask, *sqArray, *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+    unsigned sqEntries = 0, queued = 0;
+
+    std::mutex mutex;
+    std::deque<Job*> incoming;
+    bool stopping = false;
+    std::thread thread;
+
+    static int enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+        return syscall(__NR_io_uring_enter, fd, submit, complete, flags, nullptr, 0);
+    }
+
+    // Queue a request; it is handed to the kernel by the next enter()
+    io_uring_sqe &prepare(uint8_t opcode, int fd, uint64_t data) {
+        auto tail = *sqTail;
+        auto index = tail & *sqMask;
+        auto &sqe = sqes[index];
+        memset(&sqe, 0, sizeof sqe);
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.user_data = data;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+        return sqe;
+    }
+
+    void armWake() {
+        prepare(IORING_OP_POLL_ADD, wake, WAKE).poll32_events = POLLIN;
+    }
+
+    // Ask for the rest of the transfer of `job`
+    void transfer(Job *job) {
+        auto &sqe = prepare(job->write ? IORING_OP_WRITE : IORING_OP_READ, job->fd, (uint64_t)job);
+        sqe.addr = (uint64_t)(job->data.data() + job->done);
+        sqe.len = std::min<std::size_t>(job->data.size() - job->done, 1u << 30);
+        sqe.off = job->done;
+    }
+
+    void finish(Job *job) {
+        closeJob(*job);
+        finished(job);
+    }
+
+    void run() {
+        std::deque<Job*> waiting; // for a free entry of the ring
+        std::size_t active = 0;   // jobs with a transfer in the ring
+        armWake();
+        for (;;) {
+            bool stop;
+            {
+                std::lock_guard lock(mutex);
+                waiting.insert(waiting.end(), incoming.begin(), incoming.end());
+                incoming.clear();
+                stop = stopping;
+            }
+
+            // One entry stays reserved to re-arm the eventfd
+            while (!waiting.empty() && active + 1 < sqEntries) {
+                auto job = waiting.front();
+                waiting.pop_front();
+                if (!openJob(*job)) { finish(job); continue; }
+                if (job->data.empty()) { finish(job); continue; } // nothing to transfer
+                transfer(job);
+                active++;
+            }
+            if (stop && waiting.empty() && active == 0) return;
+
+            auto submitted = enter(ring, queued, 1, IORING_ENTER_GETEVENTS);
+            if (submitted < 0 && errno != EINTR && errno != EBUSY) {
+                cerr << "io_uring failed: " << strerror(errno) << endl;
+                std::abort(); // jobs in flight can neither finish nor be given up
+            }
+            if (submitted > 0) queued -= submitted;
+
+            auto head = *cqHead;
+            auto tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                auto &cqe = cqes[head & *cqMask];
+                if (cqe.user_data == WAKE) {
+                    uint64_t count;
+                    [[maybe_unused]] auto n = ::read(wake, &count, sizeof count);
+                    armWake();
+                    continue;
+                }
+
+                auto job = (Job*)cqe.user_data;
+                if (cqe.res == -EINTR || cqe.res == -EAGAIN) { transfer(job); continue; }
+                if (cqe.res <= 0) job->error = cqe.res < 0 ? -cqe.res : EIO; // a read past a shrunk file
+                else job->done += cqe.res;
+
+                if (!job->error && job->done < job->data.size()) transfer(job); // short transfer
+                else { active--; finish(job); }
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+
+public:
+    explicit UringExecutor(Done finished) : finished(std::move(finished)) {}
+
+    // Set up the ring; false if the kernel lacks io_uring, forbids it, or is
+    // too old to read and write files through it.
+    bool start() {
+        io_uring_params params = {};
+        ring = syscall(__NR_io_uring_setup, ENTRIES, &params);
+        // IORING_OP_READ and IORING_OP_WRITE came along with fast poll in 5.7
+        if (ring < 0 || !(params.features & IORING_FEAT_FAST_POLL)) return false;
+        wake = eventfd(0, EFD_CLOEXEC);
+        if (wake < 0) return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP) cqRing = sqRing;
+        else {
+            cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) return false;
+        }
+        sqes = (io_uring_sqe*)mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+
+        auto sq = (char*)sqRing, cq = (char*)cqRing;
+        sqTail = (unsigned*)(sq + params.sq_off.tail);
+        sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned*)(sq + params.sq_off.array);
+        cqHead = (unsigned*)(cq + params.cq_off.head);
+        cqTail = (unsigned*)(cq + params.cq_off.tail);
+        cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        sqEntries = params.sq_entries;
+
+        thread = std::thread([this] { run(); });
+        return true;
+    }
+
+    ~UringExecutor() override {
+        if (thread.joinable()) {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            uint64_t one = 1;
+            [[maybe_unused]] auto n = ::write(wake, &one, sizeof one);
+            thread.join();
+        }
+        if (sqes != MAP_FAILED) munmap(sqes, sqEntries * sizeof(io_uring_sqe));
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (wake >= 0) close(wake);
+        if (ring >= 0) close(ring);
+    }
+
+    void submit(Job *job) override {
+        {
+            std::lock_guard lock(mutex);
+            incoming.push_back(job);
+        }
+        uint64_t one = 1;
+        [[maybe_unused]] auto n = ::write(wake, &one, sizeof one);
+    }
+
+    const char *name() const override { return "io_uring"; }
+};
+
+}
+
+struct AsyncIO::State {
+    vector<fs::path> inputs;
+    std::size_t depth;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    vector<std::unique_ptr<Job>> reads; // of each input, once asked for
+    vector<bool> read;                  // whether that read is over
+    std::size_t issued = 0;             // inputs asked for so far
+    vector<vector<char>> spare;         // buffers to read into
+    std::size_t writing = 0;            // outputs not written yet
+    bool failed = false;                // whether an output could not be written
+
+    std::unique_ptr<Executor> executor;
+
+    // Ask for the inputs up to `end`, excluded
+    void issue(std::size_t end) {
+        for (end = std::min(end, inputs.size()); issued < end; issued++) {
+            auto job = std::make_unique<Job>();
+            job->write = false;
+            job->path = inputs[issued];
+            job->input = issued;
+            if (!spare.empty()) {
+                job->data = std::move(spare.back());
+                spare.pop_back();
+            }
+            executor->submit(job.get());
+            reads[issued] = std::move(job);
+        }
+    }
+
+    void finished(Job *job) {
+        if (job->write) {
+            if (job->error)
+                cerr << "Unable to write " << job->path << ": " << strerror(job->error) << endl;
+            if (job->written) job->written(job->error == 0);
+            std::lock_guard lock(mutex);
+            failed |= job->error != 0;
+            writing--;
+            delete job;
+        } else {
+            std::lock_guard lock(mutex);
+            read[job->input] = true;
+        }
+        changed.notify_all();
+    }
+};
+
+AsyncIO::AsyncIO(vector<fs::path> inputs, std::size_t depth) : state(std::make_unique<State>()) {
+    state->reads.resize(inputs.size());
+    state->read.resize(inputs.size());
+    state->inputs = std::move(inputs);
+    state->depth = std::max<std::size_t>(depth, 1);
+
+    auto finished = [state = state.get()](Job *job) { state->finished(job); };
+    auto uring = std::make_unique<UringExecutor>(finished);
+    if (uring->start()) state->executor = std::move(uring);
+    else state->executor = std::make_unique<ThreadExecutor>(finished, 4);
+}
+
+AsyncIO::~AsyncIO() {
+    flush();
+    // Stop the executor first, which may still be reading ahead into the jobs
+    state->executor.reset();
+}
+
+std::optional<vector<char>> AsyncIO::read(std::size_t i) {
+    std::unique_lock lock(state->mutex);
+    state->issue(i + 1 + state->depth);
+    state->changed.wait(lock, [&] { return state->read[i]; });
+
+    auto job = std::move(state->reads[i]);
+    if (job->error) {
+        cerr << "File error: " << job->path.string() << ": " << strerror(job->error) << endl;
+        return {};
+    }
+    return std::move(job->data);
+}
+
+void AsyncIO::recycle(vector<char> buffer) {
+    std::lock_guard lock(state->mutex);
+    buffer.clear();
+    state->spare.push_back(std::move(buffer));
+}
+
+void AsyncIO::write(fs::path file, vector<char> data, std::function<void(bool)> written) {
+    auto job = new Job{true, std::move(file), std::move(data)};
+    job->written = std::move(written);
+    {
+        std::lock_guard lock(state->mutex);
+        state->writing++;
+    }
+    state->executor->submit(job);
+}
+
+bool AsyncIO::flush() {
+    std::unique_lock lock(state->mutex);
+    state->changed.wait(lock, [&] { return state->writing == 0; });
+    return !state->failed;
+}
+
+const char *AsyncIO::backend() const {
+    return state->executor->name();
+}
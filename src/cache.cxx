@@ -0,0 +1,146 @@
+// cache.cxx
+// Copyright (c) 2025, 张子辰
+
+// This file is part of HDR Image Frame.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <initializer_list>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.hxx"
+#include "string.hxx"
+
+using std::string, std::vector, std::format;
+namespace fs = std::filesystem;
+
+namespace {
+
+// An entry is this header, then the SDR plane as packed 8-bit BGR, then the HDR
+// plane, if any, as packed half float BGR, both starting at DATA_OFFSET. It is
+// read back by the program that wrote it, so it is in the native byte order.
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t metadataSize; // of uhdr_gainmap_metadata_t, which may vary across libultrahdr
+    int32_t width, height;
+    int32_t colorGamut;
+    uint8_t hasHdr, hasGainmap, multiChannelGainmap, reserved;
+    uhdr_gainmap_metadata_t gainmap;
+};
+
+constexpr char MAGIC[8] = {'H', 'I', 'F', 'R', 'A', 'M', 'E', 0};
+constexpr uint32_t VERSION = 1;
+constexpr size_t DATA_OFFSET = (sizeof(Header) + 63) / 64 * 64;
+
+}
+
+string cache_key(const vector<char> &input, cv::Size photo, Resample mode) {
+    return format("{:016x}-{}x{}-{}.planes", fnv1a({input.data(), input.size()}), photo.width, photo.height, (int)mode);
+}
+
+std::optional<PhotoPlanes> load_planes(const fs::path &file) {
+    auto fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return {};
+    struct stat st;
+    auto size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    auto data = size >= DATA_OFFSET ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd); // the mapping outlives the descriptor
+    if (data == MAP_FAILED) return {};
+    std::shared_ptr<const void> storage(data, [size](const void *p) { munmap(const_cast<void*>(p), size); });
+
+    Header header;
+    memcpy(&header, data, sizeof header);
+    if (memcmp(header.magic, MAGIC, sizeof MAGIC) != 0 || header.version != VERSION ||
+        header.metadataSize != sizeof(uhdr_gainmap_metadata_t) ||
+        header.width <= 0 || header.height <= 0)
+        return {};
+
+    size_t pixels = (size_t)header.width * header.height;
+    if (size != DATA_OFFSET + pixels*3 + (header.hasHdr ? pixels*3*2 : 0))
+        return {}; // truncated
+
+    // The planes are only ever read from, which the read-only mapping enforces.
+    auto base = static_cast<uint8_t*>(data) + DATA_OFFSET;
+    PhotoPlanes planes;
+    planes.sdr = cv::Mat(header.height, header.width, CV_8UC3, base);
+    if (header.hasHdr)
+        planes.hdr = cv::Mat(header.height, header.width, CV_16FC3, base + pixels*3);
+    planes.colorGamut = (uhdr_color_gamut_t)header.colorGamut;
+    if (header.hasGainmap) planes.gainmap = header.gainmap;
+    planes.multiChannelGainmap = header.multiChannelGainmap;
+    planes.storage = std::move(storage);
+    return planes;
+}
+
+bool store_planes(const fs::path &file, const PhotoPlanes &planes) {
+    Header header{};
+    memcpy(header.magic, MAGIC, sizeof MAGIC);
+    header.version = VERSION;
+    header.metadataSize = sizeof(uhdr_gainmap_metadata_t);
+    header.width = planes.sdr.cols;
+    header.height = planes.sdr.rows;
+    header.colorGamut = planes.colorGamut;
+    header.hasHdr = !planes.hdr.empty();
+    header.hasGainmap = planes.gainmap.has_value();
+    header.multiChannelGainmap = planes.multiChannelGainmap;
+    if (planes.gainmap) header.gainmap = *planes.gainmap;
+
+    cv::Mat hdr = planes.hdr;
+    if (header.hasHdr && hdr.depth() != CV_16F) planes.hdr.convertTo(hdr, CV_16F);
+
+    // Written aside and renamed into place, so that no run ever maps an entry
+    // still being written, even one of another worker writing the same entry.
+    static std::atomic<unsigned> serial = 0;
+    auto temporary = file;
+    temporary += format(".{}.{}.tmp", getpid(), serial++);
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&header), sizeof header);
+        vector<char> padding(DATA_OFFSET - sizeof header);
+        out.write(padding.data(), padding.size());
+        for (auto *plane : std::initializer_list<const cv::Mat*>{&planes.sdr, &hdr})
+            for (int r = 0; r < plane->rows; r++)
+                out.write(plane->ptr<char>(r), plane->cols * plane->elemSize());
+        if (!out.good()) {
+            out.close();
+            std::error_code ec;
+            fs::remove(temporary, ec);
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    fs::rename(temporary, file, ec);
+    if (!ec) return true;
+    fs::remove(temporary, ec);
+    return false;
+}
@@ -1,106 +1,403 @@
 #include <format>
 #include <cmath>
+#include <array>
+#include <algorithm>
+#include <iterator>
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <mutex>
 
 #include "exif.hxx"
 #include "string.hxx"
 
 using namespace std::string_literals;
-using std::format, std::string, std::vector, Exiv2::ExifKey;
+using std::format, std::string, std::vector, std::optional, Exiv2::ExifKey;
 
-Metadata parseExif(const Exiv2::ExifData &exifData) {
+namespace {
+
+// The raw values of the tags the frame shows, wherever they are read from
+struct Tags {
+    optional<string> make, model, lens, iso, date, offset;
+    optional<float> aperture, focal;
+    optional<std::pair<int64_t, int64_t>> shutter; // as a fraction
+    optional<long> orientation;
+    // Degrees, minutes and seconds; references are N/S and E/W
+    optional<std::array<float, 3>> latitude, longitude;
+    optional<string> latitudeRef, longitudeRef;
+    optional<float> altitude;
+    optional<long> altitudeRef; // 1 below sea level
+};
+
+Metadata describe(const Tags &tags) {
     Metadata meta;
-    if (!exifData.empty()) {
-        if (auto key = exifData.findKey(ExifKey("Exif.Image.Make")); key != exifData.end())
-            meta.make = key->toString();
-        if (auto key = exifData.findKey(ExifKey("Exif.Image.Model")); key != exifData.end()) {
-            meta.model = key->toString();
-            if (meta.make == "") {
-                // If Make is none, try inferring it from Model
-                meta.make = meta.model.substr(0,meta.model.find(" "));
-            }
-            auto m = meta.model; std::transform(m.begin(), m.end(), m.begin(), ::tolower);
-            if (m.ends_with(" digital camera"))
-                meta.model.resize(meta.model.length()-" digital camera"s.length());
+    if (tags.make) meta.make = *tags.make;
+    if (tags.model) {
+        meta.model = *tags.model;
+        if (meta.make == "") {
+            // If Make is none, try inferring it from Model
+            meta.make = meta.model.substr(0,meta.model.find(" "));
         }
-        if (auto key = exifData.findKey(ExifKey("Exif.Photo.FNumber")); key != exifData.end()) {
-            auto val = key->toFloat();
-            auto s = format("{:.3f}", val);
-            while (s.back() == '0') s.pop_back();
-            if (s.back() == '.') s += '0';
-            meta.aperture = "f/" + s;
+        auto m = meta.model; std::transform(m.begin(), m.end(), m.begin(), ::tolower);
+        if (m.ends_with(" digital camera"))
+            meta.model.resize(meta.model.length()-" digital camera"s.length());
+    }
+    if (tags.aperture) {
+        auto s = format("{:.3f}", *tags.aperture);
+        while (s.back() == '0') s.pop_back();
+        if (s.back() == '.') s += '0';
+        meta.aperture = "f/" + s;
+    }
+    if (auto r = tags.shutter; r && r->second != 0) {
+        if (r->first >= r->second) meta.shutter = format("{}s",r->first / r->second);
+        else if (r->first > 0) meta.shutter = format("1/{}s", int(round((double)r->second/r->first)));
+    }
+    if (tags.iso)
+        meta.iso = "ISO" + *tags.iso;
+    if (tags.focal) {
+        auto s = format("{:.3f}", *tags.focal);
+        while (s.back() == '0') s.pop_back();
+        if (s.back() == '.') s += '0';
+        meta.focal = s + "mm";
+    }
+    if (tags.lens) {
+        meta.lens = *tags.lens;
+        if (meta.model != "" && meta.lens.starts_with(meta.model+" ")) {
+            meta.lens = meta.lens.substr(meta.model.length()+1);
         }
-        if (auto key = exifData.findKey(ExifKey("Exif.Photo.ExposureTime")); key != exifData.end()) {
-            auto r = key->toRational();
-            if (r.first >= r.second) meta.shutter = format("{}s",r.first / r.second);
-            else meta.shutter = format("1/{}s", int(round((double)r.second/r.first)));
+    }
+    else
+        meta.lens = "builtin lens";
+    if (tags.date && tags.date->size() >= 11) {
+        string d = *tags.date;
+        d[4] = '-'; d[7] = '-'; d[10]='T';
+        meta.date = d;
+        string offset;
+        if (tags.offset) {
+            offset = *tags.offset;
+            if (offset == "+00:00") meta.date += "Z";
+            else meta.date += offset;
         }
-        if (auto key = exifData.findKey(ExifKey("Exif.Photo.ISOSpeedRatings")); key != exifData.end())
-            meta.iso = "ISO" + key->toString();
-        if (auto key = exifData.findKey(ExifKey("Exif.Photo.FocalLength")); key != exifData.end()) {
-            float val = key->toFloat();
-            auto s = format("{:.3f}", val);
-            while (s.back() == '0') s.pop_back();
-            if (s.back() == '.') s += '0';
-            meta.focal = s + "mm";
+
+        // Move the date to UTC, so that it can be compared with the moment a
+        // logo took effect. An absent offset leaves it as it is, that is,
+        // takes the date to be in UTC already.
+        meta.taken = parse_datetime(d);
+        if (int h, m; meta.taken && sscanf(offset.c_str(), "%3d:%2d", &h, &m) == 2)
+            *meta.taken -= std::chrono::hours{h} + std::chrono::minutes{h < 0 ? -m : m};
+    }
+    if (tags.latitude && tags.longitude && tags.latitudeRef && tags.longitudeRef) {
+        auto [latD, latM, latS] = *tags.latitude;
+        auto [lonD, lonM, lonS] = *tags.longitude;
+        auto latitude = latD + latM/60.0f + latS/3600.0f;
+        auto longitude = lonD + lonM/60.0f + lonS/3600.0f;
+        meta.coordinate = format("{:.5f}{},{:.5f}{}", latitude, *tags.latitudeRef, longitude, *tags.longitudeRef);
+        if (tags.altitude) {
+            int height = std::round(*tags.altitude);
+            if (tags.altitudeRef == 1) height = -height;
+            meta.coordinate += format(",{:+}m",height);
         }
-        if (auto key = exifData.findKey(ExifKey("Exif.Photo.LensModel")); key != exifData.end()) {
-            meta.lens = key->toString();
-            if (meta.model != "" && meta.lens.starts_with(meta.model+" ")) {
-                meta.lens = meta.lens.substr(meta.model.length()+1);
-            }
+    }
+    if (tags.orientation) meta.orientation = *tags.orientation;
+    return meta;
+}
+
+// Reader of the TIFF structure an EXIF segment holds, just enough of it to pick
+// the tags above out of the three directories they live in: IFD0, and the Exif
+// and GPS directories IFD0 points to. Every offset is checked against the end
+// of the segment, so that a malformed one makes a tag missing, not a crash.
+class TiffReader {
+    const uint8_t *data;
+    size_t size;
+    bool little; // byte order, II or MM
+
+public:
+    TiffReader(const uint8_t *data, size_t size, bool little) : data(data), size(size), little(little) {}
+
+    unsigned u16(size_t pos) const {
+        return little ? data[pos] | data[pos+1] << 8 : data[pos] << 8 | data[pos+1];
+    }
+    uint32_t u32(size_t pos) const {
+        return little ? u16(pos) | u16(pos+2) << 16 : u16(pos) << 16 | u16(pos+2);
+    }
+
+    // An entry of a directory, 12 bytes: tag, type, count, then the value, or
+    // its offset if it does not fit in 4 bytes.
+    struct Entry {
+        unsigned type;
+        uint32_t count;
+        size_t value; // position of the value in the segment
+    };
+
+    // Call visit(tag, entry) for every entry of the directory at `ifd` whose
+    // value lies inside the segment.
+    template <typename Visit>
+    void walk(size_t ifd, Visit visit) const {
+        if (ifd + 2 > size) return;
+        auto entries = u16(ifd);
+        for (unsigned i = 0; i < entries; i++) {
+            auto pos = ifd + 2 + i*12;
+            if (pos + 12 > size) return;
+
+            static constexpr size_t TYPE_SIZE[] = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8};
+            auto type = u16(pos + 2);
+            auto count = u32(pos + 4);
+            if (type >= std::size(TYPE_SIZE) || TYPE_SIZE[type] == 0) continue;
+            auto bytes = (uint64_t)TYPE_SIZE[type] * count;
+            size_t value = bytes <= 4 ? pos + 8 : u32(pos + 8);
+            if (value + bytes > size) continue;
+            visit(u16(pos), Entry{type, count, value});
         }
-        else
-            meta.lens = "builtin lens";
-        if (auto key = exifData.findKey(ExifKey("Exif.Photo.DateTimeOriginal")); key != exifData.end()) {
-            string d = key->toString();
-            d[4] = '-'; d[7] = '-'; d[10]='T';
-            meta.date = d;
-            string offset;
-            if (auto key = exifData.findKey(ExifKey("Exif.Photo.OffsetTimeOriginal")); key != exifData.end()) {
-                offset = key->toString();
-                if (offset == "+00:00") meta.date += "Z";
-                else meta.date += offset;
-            }
-
-            // Move the date to UTC, so that it can be compared with the moment a
-            // logo took effect. An absent offset leaves it as it is, that is,
-            // takes the date to be in UTC already.
-            meta.taken = parse_datetime(d);
-            if (int h, m; meta.taken && sscanf(offset.c_str(), "%3d:%2d", &h, &m) == 2)
-                *meta.taken -= std::chrono::hours{h} + std::chrono::minutes{h < 0 ? -m : m};
+    }
+
+    // The value of an ASCII entry, up to its first NUL, as Exiv2 prints it
+    string ascii(const Entry &e) const {
+        auto text = reinterpret_cast<const char*>(data + e.value);
+        return string(text, strnlen(text, e.count));
+    }
+
+    // The n-th value of a numeric entry, as a fraction
+    std::pair<int64_t, int64_t> rational(const Entry &e, uint32_t n = 0) const {
+        if (n >= e.count) return {0, 0};
+        switch (e.type) {
+        case 1: case 7: return {data[e.value + n], 1};   // BYTE, UNDEFINED
+        case 3: return {u16(e.value + n*2), 1};          // SHORT
+        case 4: return {u32(e.value + n*4), 1};          // LONG
+        case 8: return {(int16_t)u16(e.value + n*2), 1}; // SSHORT
+        case 9: return {(int32_t)u32(e.value + n*4), 1}; // SLONG
+        case 5: return {u32(e.value + n*8), u32(e.value + n*8 + 4)};                   // RATIONAL
+        case 10: return {(int32_t)u32(e.value + n*8), (int32_t)u32(e.value + n*8 + 4)}; // SRATIONAL
+        default: return {0, 0};
         }
-        if (auto key = exifData.findKey(ExifKey("Exif.GPSInfo.GPSLatitude")); key != exifData.end()) {
-            // assume GPS data is complete
-            auto latitude = key->toFloat(0) + key->toFloat(1)/60.0f + key->toFloat(2)/3600.0f;
-            auto key2 = exifData.findKey(ExifKey("Exif.GPSInfo.GPSLongitude"));
-            auto longitude = key2->toFloat(0) + key2->toFloat(1)/60.0f + key2->toFloat(2)/3600.0f;
-            auto latitude_ref = exifData.findKey(ExifKey("Exif.GPSInfo.GPSLatitudeRef"))->toString();
-            auto longitude_ref = exifData.findKey(ExifKey("Exif.GPSInfo.GPSLongitudeRef"))->toString();
-            meta.coordinate = format("{:.5f}{},{:.5f}{}", latitude, latitude_ref, longitude, longitude_ref);
-            if (auto key = exifData.findKey(ExifKey("Exif.GPSInfo.GPSAltitude")); key != exifData.end()) {
-                int height = std::round(key->toFloat());
-                if (auto key = exifData.findKey(ExifKey("Exif.GPSInfo.GPSAltitudeRef")); key != exifData.end()) {
-                    if (key->toLong() == 1) height = -height;
-                }
-                meta.coordinate += format(",{:+}m",height);
-            }
+    }
+
+    float number(const Entry &e, uint32_t n = 0) const {
+        auto [num, den] = rational(e, n);
+        return den == 0 ? 0.0f : (float)num / den;
+    }
+
+    // The values of a numeric entry, separated by spaces, as Exiv2 prints them
+    string integers(const Entry &e) const {
+        string s;
+        for (uint32_t n = 0; n < e.count; n++) {
+            if (n) s += ' ';
+            s += std::to_string(rational(e, n).first);
         }
+        return s;
     }
-    return meta;
+};
+
+// The TIFF structure in the first EXIF segment of the JPEG in `buf`, that is,
+// the APP1 segment following the "Exif\0\0" signature, empty if there is none.
+std::pair<const uint8_t*, size_t> findExifSegment(const vector<char> &buf) {
+    auto data = reinterpret_cast<const uint8_t*>(buf.data());
+    if (buf.size() < 4 || data[0] != 0xFF || data[1] != 0xD8) return {};
+
+    size_t pos = 2;
+    while (pos + 4 <= buf.size()) {
+        if (data[pos] != 0xFF) return {};
+        auto marker = data[pos + 1];
+        if (marker == 0xFF) { pos++; continue; } // fill byte
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { pos += 2; continue; } // no length
+        if (marker == 0xD9 || marker == 0xDA) return {}; // the metadata comes before the scan
+
+        size_t length = data[pos + 2] << 8 | data[pos + 3];
+        if (length < 2 || pos + 2 + length > buf.size()) return {};
+        if (marker == 0xE1 && length >= 8 && memcmp(data + pos + 4, "Exif\0\0", 6) == 0)
+            return {data + pos + 10, length - 8};
+        pos += 2 + length;
+    }
+    return {};
 }
 
-Exiv2::ExifData getExif(const vector<char> &buf) {
-    auto image = Exiv2::ImageFactory::open(reinterpret_cast<const Exiv2::byte*>(buf.data()), buf.size());
-    image->readMetadata();
-    return image->exifData();
+// A reader of the TIFF structure at `data`, nothing if its header is not one
+optional<TiffReader> openTiff(const uint8_t *data, size_t size) {
+    if (!data || size < 8) return {};
+    if (memcmp(data, "II*\0", 4) == 0) return TiffReader(data, size, true);
+    if (memcmp(data, "MM\0*", 4) == 0) return TiffReader(data, size, false);
+    return {};
+}
+
+// Make Exiv2 safe to call from several threads, on its first use. The XMP
+// toolkit it decodes XMP packets with, as UltraHDR photos all carry, is not,
+// unless set up with a lock before any thread calls into it.
+void initializeExiv2() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        // Taken around every call into the XMP toolkit. Exiv2 takes it again
+        // when it registers a namespace met while decoding, hence recursive.
+        static std::recursive_mutex xmpMutex;
+        Exiv2::XmpParser::initialize([](void *mutex, bool lock) {
+            auto m = static_cast<std::recursive_mutex*>(mutex);
+            if (lock) m->lock();
+            else m->unlock();
+        }, &xmpMutex);
+        std::atexit([] { Exiv2::XmpParser::terminate(); });
+    });
+}
+
+}
+
+Metadata parseExif(const Exiv2::ExifData &exifData) {
+    if (exifData.empty()) return Metadata(); // not even the builtin lens
+
+    Tags tags;
+    if (auto key = exifData.findKey(ExifKey("Exif.Image.Make")); key != exifData.end())
+        tags.make = key->toString();
+    if (auto key = exifData.findKey(ExifKey("Exif.Image.Model")); key != exifData.end())
+        tags.model = key->toString();
+    if (auto key = exifData.findKey(ExifKey("Exif.Image.Orientation")); key != exifData.end())
+        tags.orientation = key->toLong();
+    if (auto key = exifData.findKey(ExifKey("Exif.Photo.FNumber")); key != exifData.end())
+        tags.aperture = key->toFloat();
+    if (auto key = exifData.findKey(ExifKey("Exif.Photo.ExposureTime")); key != exifData.end())
+        tags.shutter = key->toRational();
+    if (auto key = exifData.findKey(ExifKey("Exif.Photo.ISOSpeedRatings")); key != exifData.end())
+        tags.iso = key->toString();
+    if (auto key = exifData.findKey(ExifKey("Exif.Photo.FocalLength")); key != exifData.end())
+        tags.focal = key->toFloat();
+    if (auto key = exifData.findKey(ExifKey("Exif.Photo.LensModel")); key != exifData.end())
+        tags.lens = key->toString();
+    if (auto key = exifData.findKey(ExifKey("Exif.Photo.DateTimeOriginal")); key != exifData.end())
+        tags.date = key->toString();
+    if (auto key = exifData.findKey(ExifKey("Exif.Photo.OffsetTimeOriginal")); key != exifData.end())
+        tags.offset = key->toString();
+    if (auto key = exifData.findKey(ExifKey("Exif.GPSInfo.GPSLatitude")); key != exifData.end() && key->count() >= 3)
+        tags.latitude = {key->toFloat(0), key->toFloat(1), key->toFloat(2)};
+    if (auto key = exifData.findKey(ExifKey("Exif.GPSInfo.GPSLongitude")); key != exifData.end() && key->count() >= 3)
+        tags.longitude = {key->toFloat(0), key->toFloat(1), key->toFloat(2)};
+    if (auto key = exifData.findKey(ExifKey("Exif.GPSInfo.GPSLatitudeRef")); key != exifData.end())
+        tags.latitudeRef = key->toString();
+    if (auto key = exifData.findKey(ExifKey("Exif.GPSInfo.GPSLongitudeRef")); key != exifData.end())
+        tags.longitudeRef = key->toString();
+    if (auto key = exifData.findKey(ExifKey("Exif.GPSInfo.GPSAltitude")); key != exifData.end())
+        tags.altitude = key->toFloat();
+    if (auto key = exifData.findKey(ExifKey("Exif.GPSInfo.GPSAltitudeRef")); key != exifData.end())
+        tags.altitudeRef = key->toLong();
+    return describe(tags);
+}
+
+optional<Metadata> readExif(const vector<char> &buf) {
+    auto [data, size] = findExifSegment(buf);
+    auto reader = openTiff(data, size);
+    if (!reader) return {};
+    auto &tiff = *reader;
+
+    Tags tags;
+    size_t exifIfd = 0, gpsIfd = 0;
+    tiff.walk(tiff.u32(4), [&](unsigned tag, const TiffReader::Entry &e) {
+        switch (tag) {
+        case 0x010F: tags.make = tiff.ascii(e); break;
+        case 0x0110: tags.model = tiff.ascii(e); break;
+        case 0x0112: tags.orientation = tiff.rational(e).first; break;
+        case 0x8769: exifIfd = tiff.rational(e).first; break;
+        case 0x8825: gpsIfd = tiff.rational(e).first; break;
+        }
+    });
+    if (exifIfd) tiff.walk(exifIfd, [&](unsigned tag, const TiffReader::Entry &e) {
+        switch (tag) {
+        case 0x829A: tags.shutter = tiff.rational(e); break;
+        case 0x829D: tags.aperture = tiff.number(e); break;
+        case 0x8827: tags.iso = tiff.integers(e); break;
+        case 0x9003: tags.date = tiff.ascii(e); break;
+        case 0x9011: tags.offset = tiff.ascii(e); break;
+        case 0x920A: tags.focal = tiff.number(e); break;
+        case 0xA434: tags.lens = tiff.ascii(e); break;
+        }
+    });
+    if (gpsIfd) tiff.walk(gpsIfd, [&](unsigned tag, const TiffReader::Entry &e) {
+        switch (tag) {
+        case 1: tags.latitudeRef = tiff.ascii(e); break;
+        case 3: tags.longitudeRef = tiff.ascii(e); break;
+        case 5: tags.altitudeRef = tiff.rational(e).first; break;
+        case 6: tags.altitude = tiff.number(e); break;
+        case 2: case 4:
+            if (e.count >= 3)
+                (tag == 2 ? tags.latitude : tags.longitude) = {tiff.number(e, 0), tiff.number(e, 1), tiff.number(e, 2)};
+            break;
+        }
+    });
+    return describe(tags);
+}
+
+optional<ExifSegment> ExifSegment::read(const vector<char> &buf) {
+    auto [data, size] = findExifSegment(buf);
+    auto tiff = openTiff(data, size);
+    if (!tiff) return {};
+
+    // The segment, from its signature on, which precedes the TIFF structure
+    ExifSegment exif;
+    exif.segment.assign(data - 6, data + size);
+    exif.little = memcmp(data, "II", 2) == 0;
+    tiff->walk(tiff->u32(4), [&](unsigned tag, const TiffReader::Entry &e) {
+        if ((e.type != 3 && e.type != 4) || e.count != 1) return; // SHORT or LONG
+        Field field{e.value + 6, e.type};
+        if (tag == 0x0112) exif.orientation = field;
+        else if (tag == 0x0100) exif.width = field;
+        else if (tag == 0x0101) exif.height = field;
+    });
+    return exif;
+}
+
+void ExifSegment::patch(int width, int height) {
+    auto put = [&](Field field, uint32_t value) {
+        if (!field.position) return;
+        auto p = segment.data() + field.position;
+        int bytes = field.type == 3 ? 2 : 4;
+        for (int i = 0; i < bytes; i++)
+            p[little ? i : bytes - 1 - i] = value >> 8*i;
+    };
+    put(orientation, 1);
+    put(this->width, width);
+    put(this->height, height);
 }
 
 vector<uint8_t> getIcc(const vector<char> &buf) {
+    auto data = reinterpret_cast<const uint8_t*>(buf.data());
+    if (buf.size() < 4 || data[0] != 0xFF || data[1] != 0xD8) return {};
+
+    // The profile is cut into APP2 segments, each "ICC_PROFILE\0", then its
+    // number from 1 and their count, then its part of the profile.
+    constexpr char SIGNATURE[] = "ICC_PROFILE";
+    vector<std::pair<int, vector<uint8_t>>> chunks;
+    int count = 0;
+    size_t pos = 2;
+    while (pos + 4 <= buf.size()) {
+        if (data[pos] != 0xFF) break;
+        auto marker = data[pos + 1];
+        if (marker == 0xFF) { pos++; continue; }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { pos += 2; continue; }
+        if (marker == 0xD9 || marker == 0xDA) break;
+
+        size_t length = data[pos + 2] << 8 | data[pos + 3];
+        if (length < 2 || pos + 2 + length > buf.size()) break;
+        if (marker == 0xE2 && length >= 16 && memcmp(data + pos + 4, SIGNATURE, sizeof SIGNATURE) == 0) {
+            count = data[pos + 17];
+            chunks.emplace_back(data[pos + 16], vector<uint8_t>(data + pos + 18, data + pos + 2 + length));
+        }
+        pos += 2 + length;
+    }
+    if (chunks.empty() || (int)chunks.size() != count) return {}; // some part missing
+
+    std::sort(chunks.begin(), chunks.end(), [](auto &a, auto &b) { return a.first < b.first; });
+    vector<uint8_t> profile;
+    for (auto &chunk : chunks) profile.insert(profile.end(), chunk.second.begin(), chunk.second.end());
+    return profile;
+}
+
+Exiv2::ExifData getExif(const vector<char> &buf) {
+    initializeExiv2();
     auto image = Exiv2::ImageFactory::open(reinterpret_cast<const Exiv2::byte*>(buf.data()), buf.size());
     image->readMetadata();
-    if (!image->iccProfileDefined()) return {};
+    return image->exifData();
+}
 
-    auto profile = image->iccProfile();
-    return {profile->pData_, profile->pData_ + profile->size_};
+void pruneMakerNotes(Exiv2::ExifData &exifData) {
+    for (auto it = exifData.begin(); it != exifData.end();) {
+        auto group = it->groupName();
+        if (it->key() == "Exif.Photo.MakerNote" || group == "MakerNote" || Exiv2::ExifTags::isMakerGroup(group))
+            it = exifData.erase(it);
+        else
+            ++it;
+    }
 }
@@ -25,13 +25,16 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <string>
+#include <fstream>
+#include <cerrno>
+#include <algorithm>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <filesystem>
 
 #include "filesystem.hxx"
 
-using std::string;
+using std::string, std::vector;
 namespace fs = std::filesystem;
 
 fs::path get_executable_directory() {
@@ -53,3 +56,21 @@ std::error_code create_parent_directory(const fs::path &file) {
     fs::create_directories(dir, ec);
     return ec;
 }
+
+std::error_code read_file(const fs::path &file, vector<char> &data, size_t limit) {
+    std::ifstream in(file, std::ios::binary | std::ios::ate);
+    if (!in) return {errno, std::generic_category()};
+    data.resize(std::min<size_t>(in.tellg(), limit));
+    in.seekg(0);
+    if (!in.read(data.data(), data.size())) return std::make_error_code(std::errc::io_error);
+    return {};
+}
+
+std::error_code write_file(const fs::path &file, const vector<char> &data) {
+    std::ofstream out(file, std::ios::binary | std::ios::trunc);
+    if (!out) return {errno, std::generic_category()};
+    out.write(data.data(), data.size());
+    out.close();
+    if (!out) return std::make_error_code(std::errc::io_error);
+    return {};
+}
@@ -0,0 +1,497 @@
+// jpeg.cxx
+// Copyright (c) 2025, 张子辰
+
+// This file is part of HDR Image Frame.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <csetjmp>
+#include <climits>
+#include <algorithm>
+#include <iostream>
+#include <string_view>
+
+#include <jpeglib.h>
+#include <opencv2/imgproc.hpp>
+
+#include "jpeg.hxx"
+
+using std::vector, std::cerr, std::endl;
+using namespace std::string_view_literals;
+
+namespace {
+
+// Big endian 16-bit integer at `p`, as every field of a JPEG marker segment
+unsigned read16(const char *p) {
+    return (uint8_t)p[0] << 8 | (uint8_t)p[1];
+}
+
+}
+
+std::optional<cv::Size> jpeg_size(const vector<char> &buf) {
+    if (buf.size() < 4 || (uint8_t)buf[0] != 0xFF || (uint8_t)buf[1] != 0xD8) return {};
+
+    // Walk the marker segments following SOI, up to the first frame header.
+    size_t pos = 2;
+    while (pos + 4 <= buf.size()) {
+        if ((uint8_t)buf[pos] != 0xFF) return {};
+        uint8_t marker = buf[pos + 1];
+        if (marker == 0xFF) { pos++; continue; } // fill byte
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { pos += 2; continue; } // no length
+        if (marker == 0xD9 || marker == 0xDA) return {}; // EOI, or SOS before any frame
+
+        auto length = read16(&buf[pos + 2]);
+        // SOF0 to SOF15, save DHT, JPG and DAC, which share the range
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (length < 7 || pos + 9 > buf.size()) return {};
+            auto height = read16(&buf[pos + 5]), width = read16(&buf[pos + 7]);
+            if (width == 0 || height == 0) return {}; // height defined by DNL, unsupported
+            return cv::Size(width, height);
+        }
+        pos += 2 + length;
+    }
+    return {};
+}
+
+bool may_be_uhdr(const vector<char> &buf) {
+    if (buf.size() < 4 || (uint8_t)buf[0] != 0xFF || (uint8_t)buf[1] != 0xD8) return false;
+
+    // The segments preceding the scan, walked as in jpeg_size(). An UltraHDR
+    // image lists its gain map in an MPF segment, and announces it by the XMP
+    // of Adobe's gain map (hdrgm), or the version segment of ISO 21496-1; any
+    // of them is enough to hand the image to libultrahdr.
+    size_t pos = 2;
+    while (pos + 4 <= buf.size()) {
+        if ((uint8_t)buf[pos] != 0xFF) return false;
+        uint8_t marker = buf[pos + 1];
+        if (marker == 0xFF) { pos++; continue; }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { pos += 2; continue; }
+        if (marker == 0xD9 || marker == 0xDA) return false;
+
+        auto length = read16(&buf[pos + 2]);
+        if (marker == 0xE1 || marker == 0xE2) {
+            std::string_view payload(buf.data() + pos + 4, std::min<size_t>(std::max(length, 2u) - 2, buf.size() - pos - 4));
+            if (marker == 0xE2 && (payload.starts_with("MPF\0"sv) || payload.starts_with("urn:iso:std:iso:ts:21496:-1"sv)))
+                return true;
+            if (marker == 0xE1 && payload.starts_with("http://ns.adobe.com/xap/1.0/"sv) &&
+                payload.find("hdrgm"sv) != std::string_view::npos)
+                return true;
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+
+namespace {
+
+// libjpeg reports a fatal error by calling error_exit(), which must not return;
+// it jumps back to the caller instead, which gives up on the photo.
+struct Failure {
+    jpeg_error_mgr manager;
+    std::jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+[[noreturn]] void fail(j_common_ptr info) {
+    auto failure = (Failure*)info->err;
+    failure->manager.format_message(info, failure->message);
+    std::longjmp(failure->jump, 1);
+}
+
+// The DCT of JPEG is the orthonormal 8×8 DCT-II: F = C·X·Cᵀ, X = Cᵀ·F·C.
+struct Dct {
+    float c[8][8];
+
+    Dct() {
+        for (int u = 0; u < 8; u++)
+            for (int x = 0; x < 8; x++)
+                c[u][x] = (u == 0 ? std::sqrt(0.125f) : 0.5f) * std::cos((2*x + 1) * u * (float)M_PI / 16);
+    }
+
+    // Quantized coefficients of the samples of a block, with `quant` in
+    // natural order, as libjpeg keeps it
+    void forward(const float samples[64], const UINT16 *quant, JCOEF *block) const {
+        float rows[64];
+        for (int y = 0; y < 8; y++)
+            for (int u = 0; u < 8; u++) {
+                float sum = 0;
+                for (int x = 0; x < 8; x++) sum += c[u][x] * (samples[y*8 + x] - 128);
+                rows[y*8 + u] = sum;
+            }
+        for (int v = 0; v < 8; v++)
+            for (int u = 0; u < 8; u++) {
+                float sum = 0;
+                for (int y = 0; y < 8; y++) sum += c[v][y] * rows[y*8 + u];
+                block[v*8 + u] = (JCOEF)std::lround(sum / quant[v*8 + u]);
+            }
+    }
+
+    // Samples of a block from its quantized coefficients, as a decoder sees them
+    void inverse(const JCOEF *block, const UINT16 *quant, float samples[64]) const {
+        float rows[64];
+        for (int y = 0; y < 8; y++)
+            for (int u = 0; u < 8; u++) {
+                float sum = 0;
+                for (int v = 0; v < 8; v++) sum += c[v][y] * block[v*8 + u] * quant[v*8 + u];
+                rows[y*8 + u] = sum;
+            }
+        for (int y = 0; y < 8; y++)
+            for (int x = 0; x < 8; x++) {
+                float sum = 0;
+                for (int u = 0; u < 8; u++) sum += c[u][x] * rows[y*8 + u];
+                samples[y*8 + x] = std::clamp(std::round(sum + 128), 0.f, 255.f);
+            }
+    }
+};
+
+}
+
+struct DctPhoto::Codec {
+    jpeg_decompress_struct source = {};
+    jpeg_compress_struct target = {};
+    Failure failure;
+    // Output of the encoder, allocated by libjpeg
+    unsigned char *output = nullptr;
+    unsigned long outputSize = 0;
+
+    Codec() {
+        source.err = target.err = jpeg_std_error(&failure.manager);
+        failure.manager.error_exit = fail;
+    }
+
+    ~Codec() {
+        jpeg_destroy_compress(&target);
+        jpeg_destroy_decompress(&source);
+        free(output);
+    }
+};
+
+DctPhoto::DctPhoto(std::unique_ptr<Codec> codec) : codec(std::move(codec)) {}
+DctPhoto::DctPhoto(DctPhoto&&) noexcept = default;
+DctPhoto &DctPhoto::operator=(DctPhoto&&) noexcept = default;
+DctPhoto::~DctPhoto() = default;
+
+std::optional<DctPhoto> DctPhoto::open(const vector<char> &buf) {
+    auto codec = std::make_unique<Codec>();
+    auto &source = codec->source;
+    if (setjmp(codec->failure.jump)) return {};
+
+    jpeg_create_decompress(&source);
+    jpeg_mem_src(&source, (const unsigned char*)buf.data(), buf.size());
+    jpeg_read_header(&source, TRUE);
+
+    // The canvas is converted the way libjpeg converts RGB for compression,
+    // which must be how the photo was converted. A grayscale photo would make
+    // a grayscale output, logo and all, so it is framed the usual way.
+    if (source.jpeg_color_space != JCS_YCbCr || source.num_components != 3)
+        return {};
+    return DctPhoto(std::move(codec));
+}
+
+cv::Size DctPhoto::size() const {
+    return cv::Size(codec->source.image_width, codec->source.image_height);
+}
+
+cv::Size DctPhoto::mcu() const {
+    auto &source = codec->source;
+    return cv::Size(source.max_h_samp_factor * DCTSIZE, source.max_v_samp_factor * DCTSIZE);
+}
+
+bool DctPhoto::compose(const cv::Mat &canvas, cv::Point at, vector<uchar> &out) {
+    auto &source = codec->source;
+    auto &target = codec->target;
+    auto components = source.num_components;
+    int maxH = source.max_h_samp_factor, maxV = source.max_v_samp_factor;
+
+    // The canvas, in the color space of the photo, each component at its own
+    // resolution and padded to whole blocks by repeating its edge, as libjpeg
+    // does. Done first, as nothing may need destroying once libjpeg may fail.
+    vector<cv::Mat> planes;
+    cv::Mat ycc;
+    cv::cvtColor(canvas, ycc, cv::COLOR_BGR2YCrCb);
+    cv::split(ycc, planes);
+    std::swap(planes[1], planes[2]); // OpenCV puts Cr before Cb
+    for (int ci = 0; ci < components; ci++) {
+        auto &info = source.comp_info[ci];
+        auto &plane = planes[ci];
+        cv::Size size((canvas.cols * info.h_samp_factor + maxH - 1) / maxH,
+                      (canvas.rows * info.v_samp_factor + maxV - 1) / maxV);
+        if (size != plane.size()) cv::resize(plane, plane, size, 0, 0, cv::INTER_AREA);
+        // Whole MCUs, as many blocks as libjpeg reads from the array
+        int cols = (size.width + DCTSIZE - 1) / DCTSIZE, rows = (size.height + DCTSIZE - 1) / DCTSIZE;
+        cols = (cols + info.h_samp_factor - 1) / info.h_samp_factor * info.h_samp_factor;
+        rows = (rows + info.v_samp_factor - 1) / info.v_samp_factor * info.v_samp_factor;
+        cv::copyMakeBorder(plane, plane, 0, rows * DCTSIZE - size.height, 0, cols * DCTSIZE - size.width,
+                           cv::BORDER_REPLICATE);
+        plane.convertTo(plane, CV_32F);
+    }
+    static const Dct dct;
+
+    if (setjmp(codec->failure.jump)) {
+        cerr << "Unable to copy the photo: " << codec->failure.message << endl;
+        return false;
+    }
+
+    auto coefficients = jpeg_read_coefficients(&source);
+
+    jpeg_create_compress(&target);
+    jpeg_mem_dest(&target, &codec->output, &codec->outputSize);
+    jpeg_copy_critical_parameters(&source, &target);
+    target.image_width = canvas.cols;
+    target.image_height = canvas.rows;
+    target.optimize_coding = TRUE; // costs nothing to the pixels
+
+    jvirt_barray_ptr arrays[MAX_COMPONENTS];
+    for (int ci = 0; ci < components; ci++)
+        arrays[ci] = target.mem->request_virt_barray((j_common_ptr)&target, JPOOL_IMAGE, TRUE,
+                                                      planes[ci].cols / DCTSIZE, planes[ci].rows / DCTSIZE,
+                                                      target.comp_info[ci].v_samp_factor);
+    target.mem->realize_virt_arrays((j_common_ptr)&target);
+
+    for (int ci = 0; ci < components; ci++) {
+        auto &info = source.comp_info[ci];
+        auto &plane = planes[ci];
+        auto quant = target.comp_info[ci].quant_tbl_no;
+        auto table = target.quant_tbl_ptrs[quant]->quantval;
+        auto sourceTable = info.quant_table->quantval;
+
+        // Samples of the photo in this component. at is a multiple of the MCU,
+        // so its blocks line up with those of the canvas. A photo reaching an
+        // edge of the canvas owns whatever padding lies past it.
+        int px = at.x * info.h_samp_factor / maxH, py = at.y * info.v_samp_factor / maxV;
+        int pw = info.downsampled_width, ph = info.downsampled_height;
+        int right = px + pw, bottom = py + ph;
+        if (at.x + (int)source.image_width >= canvas.cols) right = INT_MAX;
+        if (at.y + (int)source.image_height >= canvas.rows) bottom = INT_MAX;
+        int sourceCols = info.width_in_blocks, sourceRows = info.height_in_blocks;
+
+        for (int by = 0; by < plane.rows / DCTSIZE; by++) {
+            auto row = target.mem->access_virt_barray((j_common_ptr)&target, arrays[ci], by, 1, TRUE)[0];
+            int y0 = by * DCTSIZE, sy = by - py / DCTSIZE;
+            JBLOCKROW sourceRow = nullptr;
+            if (y0 < bottom && y0 + DCTSIZE > py && sy < sourceRows)
+                sourceRow = source.mem->access_virt_barray((j_common_ptr)&source, coefficients[ci], sy, 1, FALSE)[0];
+
+            for (int bx = 0; bx < plane.cols / DCTSIZE; bx++) {
+                int x0 = bx * DCTSIZE, sx = bx - px / DCTSIZE;
+                auto block = row[bx];
+                bool photo = sourceRow && x0 < right && x0 + DCTSIZE > px && sx < sourceCols;
+                // Entirely the photo: copied as is
+                if (photo && x0 + DCTSIZE <= right && y0 + DCTSIZE <= bottom) {
+                    std::copy_n(sourceRow[sx], DCTSIZE2, block);
+                    continue;
+                }
+
+                // Entirely the frame, or astride its edge: compressed afresh
+                float samples[DCTSIZE2], photoSamples[DCTSIZE2];
+                for (int y = 0; y < DCTSIZE; y++)
+                    std::copy_n(plane.ptr<float>(y0 + y, x0), DCTSIZE, samples + y*DCTSIZE);
+                if (photo) {
+                    dct.inverse(sourceRow[sx], sourceTable, photoSamples);
+                    for (int y = 0; y < DCTSIZE; y++)
+                        for (int x = 0; x < DCTSIZE; x++)
+                            if (y0 + y < bottom && x0 + x < right) samples[y*DCTSIZE + x] = photoSamples[y*DCTSIZE + x];
+                }
+                dct.forward(samples, table, block);
+            }
+        }
+    }
+
+    jpeg_write_coefficients(&target, arrays);
+    jpeg_finish_compress(&target);
+    out.assign(codec->output, codec->output + codec->outputSize);
+    return true;
+}
+
+namespace {
+
+// Compress rows [first, first + count) of `image`, BGR, as a JPEG of its own,
+// into `data`, allocated by libjpeg; with a restart marker after every row of
+// MCUs if `restart` is set.
+bool compressStrip(const cv::Mat &image, int first, int count, int quality, bool restart,
+                   unsigned char *&data, unsigned long &size) {
+    jpeg_compress_struct info = {};
+    Failure failure;
+    info.err = jpeg_std_error(&failure.manager);
+    failure.manager.error_exit = fail;
+    if (setjmp(failure.jump)) {
+        cerr << "Unable to compress the image: " << failure.message << endl;
+        jpeg_destroy_compress(&info);
+        return false;
+    }
+
+    jpeg_create_compress(&info);
+    jpeg_mem_dest(&info, &data, &size);
+    info.image_width = image.cols;
+    info.image_height = count;
+    info.input_components = 3;
+    info.in_color_space = JCS_EXT_BGR;
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, quality, TRUE);
+    // The strips are joined under the headers of the first, so they must all
+    // be coded with the same Huffman tables: the standard ones, in a single
+    // sequential scan. libjpeg defaults to that, but builds such as mozjpeg
+    // default to tables optimized for each image, and to progressive scans.
+    info.optimize_coding = FALSE;
+    info.scan_info = nullptr;
+    info.num_scans = 0;
+    if (restart) info.restart_in_rows = 1;
+
+    jpeg_start_compress(&info, TRUE);
+    while (info.next_scanline < info.image_height) {
+        auto row = (JSAMPROW)image.ptr<uchar>(first + info.next_scanline);
+        jpeg_write_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_compress(&info);
+    jpeg_destroy_compress(&info);
+    return true;
+}
+
+// Offset of the marker segment `marker` in the headers of a JPEG, or of the
+// entropy-coded data if `marker` is SOS; 0 if not found.
+size_t findSegment(const unsigned char *data, size_t size, uint8_t marker) {
+    for (size_t pos = 2; pos + 4 <= size && data[pos] == 0xFF;) {
+        auto length = read16((const char*)data + pos + 2);
+        if (data[pos + 1] == marker) return marker == 0xDA ? pos + 2 + length : pos;
+        pos += 2 + length;
+    }
+    return 0;
+}
+
+}
+
+bool encode_jpeg(const cv::Mat &image, int quality, vector<uchar> &out) {
+    // libjpeg defaults to 2×2 chroma subsampling, hence MCUs of 16×16 pixels.
+    // Cutting the image between rows of MCUs leaves every block as it would be
+    // in one piece, as well as every subsampled chroma value.
+    constexpr int MCU = 16;
+    int mcuRows = (image.rows + MCU - 1) / MCU;
+    int strips = std::clamp(cv::getNumThreads(), 1, std::max(mcuRows, 1));
+    int rows = (mcuRows + strips - 1) / strips * MCU; // of each strip but the last
+    strips = (image.rows + rows - 1) / rows;
+
+    struct Strip {
+        unsigned char *data = nullptr;
+        unsigned long size = 0;
+        bool compressed = false;
+    };
+    vector<Strip> parts(strips);
+    cv::parallel_for_(cv::Range(0, strips), [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; i++) {
+            auto &part = parts[i];
+            part.compressed = compressStrip(image, i * rows, std::min(rows, image.rows - i * rows), quality,
+                                            strips > 1, part.data, part.size);
+        }
+    });
+    auto compressed = std::all_of(parts.begin(), parts.end(), [](auto &part) { return part.compressed; });
+
+    // The strips share their headers, standard Huffman tables included, and
+    // each of them starts its entropy-coded data afresh, as after a restart
+    // marker. So the first strip, told the height of the whole image, is
+    // followed by the data of every other one behind a restart marker, the
+    // markers numbered anew throughout.
+    if (compressed && strips == 1) out.assign(parts[0].data, parts[0].data + parts[0].size);
+    else if (compressed) {
+        auto &head = parts[0];
+        auto sof = findSegment(head.data, head.size, 0xC0), sos = findSegment(head.data, head.size, 0xDA);
+        if (sof == 0 || sos == 0) {
+            cerr << "Unable to join the strips of the image" << endl;
+            compressed = false;
+        } else {
+            out.assign(head.data, head.data + sos);
+            out[sof + 5] = image.rows >> 8;
+            out[sof + 6] = image.rows & 0xFF;
+
+            unsigned restarts = 0;
+            for (int i = 0; i < strips; i++) {
+                auto &part = parts[i];
+                auto start = i == 0 ? sos : findSegment(part.data, part.size, 0xDA);
+                auto end = part.size - 2; // EOI
+                if (i > 0) {
+                    out.push_back(0xFF);
+                    out.push_back(0xD0 + restarts++ % 8);
+                }
+                for (auto pos = start; pos < end; pos++) {
+                    out.push_back(part.data[pos]);
+                    if (part.data[pos] != 0xFF) continue;
+                    auto marker = part.data[++pos]; // 0 if the 0xFF is data
+                    out.push_back(marker >= 0xD0 && marker <= 0xD7 ? 0xD0 + restarts++ % 8 : marker);
+                }
+            }
+            out.push_back(0xFF);
+            out.push_back(0xD9);
+        }
+    }
+
+    for (auto &part : parts) free(part.data);
+    return compressed;
+}
+
+bool insert_metadata(vector<uchar> &jpeg, const vector<uint8_t> &exif, const vector<uint8_t> &icc) {
+    if (jpeg.size() < 6 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) return false;
+
+    // The segments go after SOI, and the JFIF segment if any, which must come
+    // first. Their length is 16-bit, and counts itself.
+    constexpr size_t MAX_PAYLOAD = 65533;
+    size_t at = 2;
+    if (jpeg[2] == 0xFF && jpeg[3] == 0xE0) at += 2 + read16((const char*)&jpeg[4]);
+    if (at > jpeg.size()) return false;
+
+    vector<uchar> segments;
+    auto segment = [&](uchar marker, size_t payload) {
+        segments.insert(segments.end(), {0xFF, marker, uchar((payload + 2) >> 8), uchar((payload + 2) & 0xFF)});
+    };
+    bool complete = true;
+    if (exif.size() > MAX_PAYLOAD) {
+        cerr << "EXIF data too large for a JPEG segment, left out" << endl;
+        complete = false;
+    } else if (!exif.empty()) {
+        segment(0xE1, exif.size());
+        segments.insert(segments.end(), exif.begin(), exif.end());
+    }
+
+    // The profile is cut into APP2 segments, each "ICC_PROFILE\0", then its
+    // number from 1 and their count, then its part of the profile.
+    constexpr char SIGNATURE[] = "ICC_PROFILE";
+    constexpr size_t CHUNK = MAX_PAYLOAD - sizeof SIGNATURE - 2;
+    size_t chunks = (icc.size() + CHUNK - 1) / CHUNK;
+    if (chunks > 255) {
+        cerr << "ICC profile too large for a JPEG, left out" << endl;
+        complete = false;
+    } else {
+        for (size_t i = 0; i < chunks; i++) {
+            auto first = icc.begin() + i * CHUNK, last = icc.begin() + std::min(icc.size(), (i + 1) * CHUNK);
+            segment(0xE2, sizeof SIGNATURE + 2 + (last - first));
+            segments.insert(segments.end(), SIGNATURE, SIGNATURE + sizeof SIGNATURE);
+            segments.push_back(i + 1);
+            segments.push_back(chunks);
+            segments.insert(segments.end(), first, last);
+        }
+    }
+
+    jpeg.insert(jpeg.begin() + at, segments.begin(), segments.end());
+    return complete;
+}
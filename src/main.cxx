@@ -34,13 +34,19 @@
 #include <vector>
 #include <string>
 #include <string_view>
-#include <fstream>
 #include <cmath>
 #include <algorithm>
 #include <format>
 #include <filesystem>
-
-#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <set>
+#include <tuple>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <array>
+
+#include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/imgcodecs.hpp>
 
@@ -51,13 +57,22 @@
 #include <cairo.h>
 #include <librsvg/rsvg.h>
 
+#include <sys/resource.h>
+
 #include "filesystem.hxx"
 #include "string.hxx"
 #include "text_renderer.hxx"
 #include "exif.hxx"
 #include "arguments.hxx"
-
-using std::clog, std::cerr, std::endl, std::ifstream, std::ofstream, std::ios;
+#include "scheduler.hxx"
+#include "jpeg.hxx"
+#include "cache.hxx"
+#include "memory.hxx"
+#include "watch.hxx"
+#include "async_io.hxx"
+#include "shard.hxx"
+
+using std::clog, std::cerr, std::endl;
 using std::string, std::vector, std::format;
 using cv::Mat, cv::Point, cv::Scalar;
 using namespace std::string_literals;
@@ -70,7 +85,8 @@ constexpr auto REGULAR_FONTS = {"/usr/share/fonts/truetype/noto/NotoSans-Regular
 // The photo sits above a footer holding two lines of text on the left, and the
 // camera model, the lens and the manufacturer logo on the right. Every length
 // of the frame is derived from the ones below, given in pixels at the reference
-// font size DEFAULT_FONT_SIZE and converted to the requested one by scaled().
+// font size DEFAULT_FONT_SIZE and converted to the requested one by
+// scaledLength().
 constexpr int FOOTER_PADDING = 5;     // above the top of the first line
 constexpr int DEFAULT_FONT_SIZE = 52; // main text size
 constexpr int SUB_FONT_SIZE = 40;     //
@@ -84,20 +100,64 @@ constexpr int LOGO_SPACING = 40;      // ... this far from the text on its left
 constexpr float SDR_WHITE_NITS = 203;
 constexpr float MIN_PEAK_NITS = 203, MAX_PEAK_NITS = 10000;
 
+// Linear value of each 8-bit sRGB level, pow(x/255, 2.2): what is drawn on the
+// SDR canvas in a level is drawn on the HDR one in its value.
+const auto LINEAR_LEVELS = [] {
+    std::array<float, 256> levels;
+    for (int i = 0; i < 256; i++) levels[i] = pow(i/255.f, 2.2f);
+    return levels;
+}();
+
+// Settings of the UltraHDR encoder for each --hdr-tier, indexed by HdrTier,
+// trading the time the gain map takes and its size against its fidelity.
+// Balanced leaves libultrahdr to its defaults, and the gain map to the quality
+// of the photo, as hiframe always did. Realtime and archival both quarter the
+// gain map in each dimension, which cost about 0.3 dB of PSNR in the scenes
+// they were measured on; the former computes it the quick way, the latter
+// encodes it with gamma 2 and compresses it harder, for the smallest files.
+struct HdrTierSettings {
+    std::optional<uhdr_enc_preset_t> preset; // default if unset
+    int gainmapScale;   // downscaling of the gain map, 0 for the default
+    float gainmapGamma; // gamma its values are encoded with, 0 for the default
+    int gainmapQuality; // JPEG quality of the gain map, 0 for that of the photo
+};
+constexpr HdrTierSettings HDR_TIERS[] = {
+    {UHDR_USAGE_REALTIME, 4, 1.0f, 85}, // realtime
+    {std::nullopt, 0, 0, 0},            // balanced
+    {std::nullopt, 4, 2.0f, 75},        // archival
+};
+
 // Effective time of a logo whose file name carries none. Photography is younger
 // than this, so such a logo applies to every photo.
 constexpr std::chrono::sys_seconds UNKNOWN_SINCE =
     std::chrono::sys_days{std::chrono::year{1800}/std::chrono::January/1};
 
-// The logo of `make` in use at the moment a photo was taken. Logos are named
-// `<company>.YYYY-MM-DDThh:mm:ss.png`, the timestamp being when that logo took
-// effect, in UTC. A photo whose date is unknown gets the logo in use today. The
-// path is empty if the company is unknown, or if the photo is older than every
-// logo on record for it, as no logo at all beats one of the wrong era.
-fs::path findLogo(const fs::path &dir, string make, std::optional<std::chrono::sys_seconds> taken) {
-    std::transform(make.begin(), make.end(), make.begin(), tolower);
+// The logos on record, which the logo of each photo is picked from. Logos are
+// named `<company>.YYYY-MM-DDThh:mm:ss.svg` (or .png), the timestamp being when
+// that logo took effect, in UTC. The directory is listed once per run, rather
+// than once per photo.
+struct LogoIndex {
+    struct Logo {
+        std::chrono::sys_seconds since;
+        fs::path file;
+        string company;
+    };
+    vector<Logo> logos;      // oldest logo first
+    fs::path fallback;       // for a photo of an unknown manufacturer
+};
+
+LogoIndex indexLogos() {
+    LogoIndex index;
+
+    auto dir = get_executable_directory();
+    if (fs::is_directory(dir / "../share/hiframe/logo")) dir /= "../share/hiframe/logo";
+    else if (is_directory(dir / "logo")) dir /= "logo";
+    else if (fs::is_directory(dir / "../logo")) dir /= "../logo";
+    else {
+        cerr << "Unable to find logo images" << endl;
+        return index;
+    }
 
-    vector<std::pair<std::chrono::sys_seconds, fs::path>> logos; // of this company
     for (const auto &entry : fs::directory_iterator(dir)) {
         auto extension = entry.path().extension();
         if (extension != ".svg" && extension != ".png") continue; // copyright.md, and such
@@ -106,28 +166,46 @@ fs::path findLogo(const fs::path &dir, string make, std::optional<std::chrono::s
         auto dot = stem.find('.');
         // An empty company would match every manufacturer, as in a name that
         // begins with the separator
-        if (auto company = stem.substr(0, dot);
-            company.empty() || make.find(company) == string::npos)
-            continue;
+        auto company = stem.substr(0, dot);
+        if (company.empty()) continue;
 
         auto since = dot == string::npos ? std::nullopt : parse_datetime(stem.substr(dot + 1));
         if (dot != string::npos && !since)
             cerr << "Logo " << entry.path().filename() << " has a malformed timestamp" << endl;
-        logos.emplace_back(since.value_or(UNKNOWN_SINCE), entry.path());
+        index.logos.push_back({since.value_or(UNKNOWN_SINCE), entry.path(), company});
     }
-    if (logos.empty()) return {};
+    std::sort(index.logos.begin(), index.logos.end(), [](const auto &a, const auto &b) {
+        return std::tie(a.since, a.file) < std::tie(b.since, b.file);
+    });
 
-    std::sort(logos.begin(), logos.end()); // oldest logo first
-    if (!taken) return logos.back().second;
+    index.fallback = dir / "default.svg";
+    if (!fs::exists(index.fallback)) index.fallback = dir / "default.png";
+    return index;
+}
+
+// The logo of `make` in use at the moment a photo was taken. A photo whose date
+// is unknown gets the logo in use today. The path is empty if the company is
+// unknown, or if the photo is older than every logo on record for it, as no
+// logo at all beats one of the wrong era.
+fs::path findLogo(const LogoIndex &index, string make, std::optional<std::chrono::sys_seconds> taken) {
+    std::transform(make.begin(), make.end(), make.begin(), tolower);
 
     fs::path chosen; // stays empty while no logo has taken effect yet
-    for (const auto &[since, file] : logos) {
-        if (since > *taken) break;
+    for (const auto &[since, file, company] : index.logos) {
+        if (make.find(company) == string::npos) continue; // another company
+        if (taken && since > *taken) break;
         chosen = file;
     }
     return chosen;
 }
 
+// What a worker keeps from one file to the next: the buffers of the pool, and
+// the fonts, loaded by its first file.
+struct Worker {
+    MatPool pool;
+    std::optional<TextRenderer> fontMain, fontSub;
+};
+
 // Rasterize an SVG to fit inside a box of `boxW` by `boxH`, keeping the aspect
 // ratio of the drawing. The result is BGRA with straight alpha, as the rest of
 // the program expects, and empty if the file cannot be read or rendered.
@@ -184,6 +262,36 @@ Mat renderSvg(const fs::path &file, int boxW, int boxH) {
     return logo;
 }
 
+// Resize `src` to `size`. Each plane of a photo is resampled on its own, so
+// the steps taken depend on nothing but the two sizes, for the planes to line
+// up. Lanczos weighs 8×8 source pixels for every output pixel whatever the
+// ratio, which a large reduction does not need: an area filter averages each
+// output pixel over the source pixels it covers, as sharp for a downscale, and
+// the fast mode first halves the photo with a Gaussian pyramid, each level a
+// quarter of the cost of the previous one, leaving a reduction under 2× to the
+// area filter. An enlargement gets bicubic and bilinear filters respectively.
+void resample(const Mat &src, Mat &dst, cv::Size size, Resample mode) {
+    auto shrinking = size.width < src.cols;
+    switch (mode) {
+    case Resample::Lanczos:
+        resize(src, dst, size, 0, 0, cv::INTER_LANCZOS4);
+        break;
+    case Resample::Balanced:
+        resize(src, dst, size, 0, 0, shrinking ? cv::INTER_AREA : cv::INTER_CUBIC);
+        break;
+    case Resample::Fast: {
+        Mat reduced = src;
+        while (reduced.cols >= size.width*2 && reduced.rows >= size.height*2) {
+            Mat half;
+            pyrDown(reduced, half);
+            reduced = half;
+        }
+        resize(reduced, dst, size, 0, 0, shrinking ? cv::INTER_AREA : cv::INTER_LINEAR);
+        break;
+    }
+    }
+}
+
 bool checkUhdr(uhdr_error_info_t status, const string& msg) {
     if (status.error_code != UHDR_CODEC_OK) {
         cerr << "[UltraHDR] " << msg << " Failed: " << status.error_code;
@@ -203,227 +311,593 @@ Mat wrapUhdrImage(uhdr_raw_image_t* img) {
     return Mat();
 }
 
-bool process(const string &inputPath, const string &outputPath, int quality, int targetW, int targetH, Shrink shrink, int fontSize, int margin, bool verbose) {
-    // Every length of the frame is a fixed proportion of the main font size.
-    // scaled(n) converts the length n, measured in pixels at the reference font
-    // size, to the length at the requested one; hence scaling the canvas and the
-    // font size by the same factor yields a visually identical frame.
-    auto scaled = [ratio = (double)fontSize / DEFAULT_FONT_SIZE](int length) {
-        return (int)std::lround(length * ratio);
-    };
+// Whether `buffer` holds an UltraHDR photo. libultrahdr sets up a decoder to
+// tell, so it is only asked about a photo whose markers announce a gain map.
+bool isUhdr(vector<char> &buffer) {
+    return may_be_uhdr(buffer) && is_uhdr_image(buffer.data(), buffer.size());
+}
 
-    // 1. Read Input
-    ifstream file(inputPath, ios::binary | ios::ate);
-    if (!file.good()) { cerr << "File error: " << inputPath << endl; return false; }
-    size_t size = file.tellg();
-    file.seekg(0, ios::beg);
-    vector<char> buffer(size);
-    file.read(buffer.data(), size);
-
-    // 2. Decode (Dual Pass if UltraHDR)
-    Mat sdrMat, hdrMat; // sdrMat is BGR (8u), hdrMat is BGR (32f Linear)
-    auto hasHDR = false;
-    // The pixels are passed through untouched, so the output must be tagged with
-    // the color space of the input; assuming sRGB would misrepresent the wider
-    // gamut of, say, a Display P3 photo. sRGB is the fallback of an untagged one.
-    auto colorGamut = UHDR_CG_BT_709;
-    // Gain map of the input, reproduced for the output, see below
-    uhdr_gainmap_metadata_t gainmap;
-    auto hasGainmap = false;
-    auto multiChannelGainmap = true; // what the encoder writes unless told otherwise
-
-    if(verbose) clog << "Decoding SDR plane..." << endl;
-    sdrMat = cv::imdecode(buffer, cv::IMREAD_COLOR);
-    if (sdrMat.empty()) { cerr << "Decode failed: " << inputPath << endl; return false; }
-
-    auto exif = getExif(buffer);
-
-    if (is_uhdr_image(buffer.data(), size)) {
-        if(verbose) clog << "Decoding HDR plane..." << endl;
-
-        uhdr_codec_private_t* dec = uhdr_create_decoder();
-        uhdr_compressed_image_t input_img = { buffer.data(), size, size, UHDR_CG_UNSPECIFIED, UHDR_CT_UNSPECIFIED, UHDR_CR_UNSPECIFIED };
-        uhdr_dec_set_image(dec, &input_img);
-        uhdr_dec_set_out_img_format(dec, UHDR_IMG_FMT_64bppRGBAHalfFloat);
-        uhdr_dec_set_out_color_transfer(dec, UHDR_CT_LINEAR); // Essential for raw linear data
-        uhdr_dec_probe(dec);
-        if (auto meta = uhdr_dec_get_gainmap_metadata(dec)) { gainmap = *meta; hasGainmap = true; }
-        // A gain map with one channel per color brightens them separately, a
-        // single-channel one brightens them alike; the channel count of its
-        // (JPEG) rendition tells which of the two the input carries.
-        if (auto map = uhdr_dec_get_gainmap_image(dec)) {
-            Mat compressed(1, (int)map->data_sz, CV_8U, map->data);
-            multiChannelGainmap = imdecode(compressed, cv::IMREAD_UNCHANGED).channels() > 1;
+// Decode the HDR plane of the UltraHDR photo in `buffer` into `planes`, at full
+// size, along with its gain map and color space. The plane is left empty if the
+// photo cannot be decoded.
+void decodeHdr(const vector<char> &buffer, PhotoPlanes &planes) {
+    auto size = buffer.size();
+    uhdr_codec_private_t* dec = uhdr_create_decoder();
+    uhdr_compressed_image_t input_img = { (void*)buffer.data(), size, size, UHDR_CG_UNSPECIFIED, UHDR_CT_UNSPECIFIED, UHDR_CR_UNSPECIFIED };
+    uhdr_dec_set_image(dec, &input_img);
+    uhdr_dec_set_out_img_format(dec, UHDR_IMG_FMT_64bppRGBAHalfFloat);
+    uhdr_dec_set_out_color_transfer(dec, UHDR_CT_LINEAR); // Essential for raw linear data
+    uhdr_dec_probe(dec);
+    if (auto meta = uhdr_dec_get_gainmap_metadata(dec)) planes.gainmap = *meta;
+    // A gain map with one channel per color brightens them separately, a
+    // single-channel one brightens them alike; the channel count of its
+    // (JPEG) rendition tells which of the two the input carries.
+    if (auto map = uhdr_dec_get_gainmap_image(dec)) {
+        Mat compressed(1, (int)map->data_sz, CV_8U, map->data);
+        planes.multiChannelGainmap = imdecode(compressed, cv::IMREAD_UNCHANGED).channels() > 1;
+    }
+    if (uhdr_decode(dec).error_code == UHDR_CODEC_OK) {
+        auto decoded = uhdr_get_decoded_image(dec);
+        if (decoded->cg != UHDR_CG_UNSPECIFIED) planes.colorGamut = decoded->cg;
+        auto raw16 = wrapUhdrImage(decoded); // CV_16FC4
+
+        // OpenCV cannot convert the color of a 16-bit float image, so go through
+        // 32-bit float, a few rows at a time rather than through a copy of the
+        // whole photo.
+        planes.hdr.create(raw16.size(), CV_32FC3);
+        cv::parallel_for_(cv::Range(0, raw16.rows), [&](const cv::Range &rows) {
+            constexpr int BAND = 64;
+            Mat raw32;
+            for (int r = rows.start; r < rows.end; r += BAND) {
+                cv::Range band(r, std::min(r + BAND, rows.end));
+                raw16.rowRange(band).convertTo(raw32, CV_32F);
+                cvtColor(raw32, planes.hdr.rowRange(band), cv::COLOR_RGBA2BGR);
+            }
+        });
+    }
+    // The decoder owns the decoded image as well as its own buffers
+    uhdr_release_decoder(dec);
+}
+
+// PSNR of the HDR rendition of the UltraHDR image `jpeg` against `reference`,
+// the linear RGBA half float plane it was encoded from, relative to the peak of
+// the reference; NaN if it cannot be decoded at the size of the reference.
+double hdrPsnr(const vector<char> &jpeg, const Mat &reference) {
+    auto size = jpeg.size();
+    uhdr_codec_private_t* dec = uhdr_create_decoder();
+    uhdr_compressed_image_t input_img = { (void*)jpeg.data(), size, size, UHDR_CG_UNSPECIFIED, UHDR_CT_UNSPECIFIED, UHDR_CR_UNSPECIFIED };
+    uhdr_dec_set_image(dec, &input_img);
+    uhdr_dec_set_out_img_format(dec, UHDR_IMG_FMT_64bppRGBAHalfFloat);
+    uhdr_dec_set_out_color_transfer(dec, UHDR_CT_LINEAR);
+    double psnr = NAN;
+    if (uhdr_decode(dec).error_code == UHDR_CODEC_OK) {
+        auto decoded = wrapUhdrImage(uhdr_get_decoded_image(dec)); // CV_16FC4
+        if (decoded.size() == reference.size()) {
+            // Compared a few rows at a time, in 32-bit float, leaving out alpha
+            constexpr int BAND = 64;
+            Mat raw32, expected, actual;
+            double squares = 0, peak = 0;
+            for (int r = 0; r < reference.rows; r += BAND) {
+                cv::Range band(r, std::min(r + BAND, reference.rows));
+                reference.rowRange(band).convertTo(raw32, CV_32F);
+                cvtColor(raw32, expected, cv::COLOR_RGBA2RGB);
+                decoded.rowRange(band).convertTo(raw32, CV_32F);
+                cvtColor(raw32, actual, cv::COLOR_RGBA2RGB);
+                squares += cv::norm(expected, actual, cv::NORM_L2SQR);
+                double bandPeak;
+                cv::minMaxLoc(expected.reshape(1), nullptr, &bandPeak);
+                peak = std::max(peak, bandPeak);
+            }
+            psnr = 10 * std::log10(peak * peak / (squares / (reference.total() * 3)));
         }
-        if (uhdr_decode(dec).error_code == UHDR_CODEC_OK) {
-            auto decoded = uhdr_get_decoded_image(dec);
-            if (decoded->cg != UHDR_CG_UNSPECIFIED) colorGamut = decoded->cg;
-            auto raw16 = wrapUhdrImage(decoded); // CV_16FC4
+    }
+    uhdr_release_decoder(dec);
+    return psnr;
+}
 
-            // Convert 16F -> 32F first to avoid OpenCV cvtColor issues with 16-bit float
-            Mat raw32;
-            raw16.convertTo(raw32, CV_32F);
+// EXIF thumbnail of the framed photo in `canvas`, a JPEG of at most 160 pixels
+// either way, as DCF recommends. A copied photo is missing from the canvas,
+// at `rect`, and is decoded at an eighth of its size from `copied` instead.
+vector<uint8_t> makeThumbnail(const Mat &canvas, const vector<char> *copied, cv::Rect rect) {
+    constexpr int SIZE = 160;
+    double scale = std::min(1.0, (double)SIZE / std::max(canvas.cols, canvas.rows));
+    Mat thumb;
+    resize(canvas, thumb, cv::Size(std::max(1L, std::lround(canvas.cols * scale)), std::max(1L, std::lround(canvas.rows * scale))),
+           0, 0, cv::INTER_AREA);
+
+    if (copied) {
+        auto photo = cv::imdecode(*copied, cv::IMREAD_REDUCED_COLOR_8);
+        cv::Rect area(std::lround(rect.x * scale), std::lround(rect.y * scale),
+                      std::lround(rect.width * scale), std::lround(rect.height * scale));
+        area &= cv::Rect(0, 0, thumb.cols, thumb.rows);
+        if (!photo.empty() && !area.empty()) resize(photo, thumb(area), area.size(), 0, 0, cv::INTER_AREA);
+    }
 
-            // Now safe to convert Color space on 32F image
-            cvtColor(raw32, hdrMat, cv::COLOR_RGBA2BGR);
+    vector<uint8_t> jpeg;
+    imencode(".jpg", thumb, jpeg, vector<int>{cv::IMWRITE_JPEG_QUALITY, 75});
+    return jpeg;
+}
 
-            hasHDR = true;
+// Gain map of the UltraHDR photo in `buffer`, decoded, its metadata going to
+// `planes`; empty if it cannot be read. Unlike decodeHdr, the photo itself is
+// left alone.
+Mat loadGainmap(const vector<char> &buffer, PhotoPlanes &planes) {
+    auto size = buffer.size();
+    uhdr_codec_private_t* dec = uhdr_create_decoder();
+    uhdr_compressed_image_t input_img = { (void*)buffer.data(), size, size, UHDR_CG_UNSPECIFIED, UHDR_CT_UNSPECIFIED, UHDR_CR_UNSPECIFIED };
+    uhdr_dec_set_image(dec, &input_img);
+    Mat gainmap;
+    if (uhdr_dec_probe(dec).error_code == UHDR_CODEC_OK) {
+        auto meta = uhdr_dec_get_gainmap_metadata(dec);
+        auto map = uhdr_dec_get_gainmap_image(dec);
+        if (meta && map) {
+            planes.gainmap = *meta;
+            gainmap = imdecode(Mat(1, (int)map->data_sz, CV_8U, map->data), cv::IMREAD_UNCHANGED);
         }
-        uhdr_release_decoder(dec);
+    }
+    uhdr_release_decoder(dec);
+    return gainmap;
+}
+
+// Turn `jpeg`, a frame around an UltraHDR photo at `at` of a canvas of `size`,
+// into an UltraHDR JPEG itself, with `gainmap`, that of the photo, 1/`scale`
+// of its size, set likewise into a gain map of the whole canvas. The frame is
+// as bright in HDR as in SDR, so its gain is the one encoding a boost of 1:
+// log2(1) normalized between the log2 of the smallest and largest boosts, then
+// raised to the gamma of the map.
+bool appendGainmap(vector<char> &jpeg, const Mat &gainmap, Point at, int scale, cv::Size size,
+                   const PhotoPlanes &planes, int quality) {
+    auto metadata = *planes.gainmap;
+    Scalar neutral;
+    for (int k = 0; k < gainmap.channels(); k++) {
+        int c = gainmap.channels() == 1 ? 0 : 2 - k; // BGR, the metadata being RGB
+        double low = std::log2(metadata.min_content_boost[c]), high = std::log2(metadata.max_content_boost[c]);
+        double level = high > low ? std::clamp(-low / (high - low), 0.0, 1.0) : 0.0;
+        neutral[k] = std::pow(level, (double)metadata.gamma[c]) * 255;
     }
 
-    // 3. Resize & Pad
+    Mat extended((size.height + scale - 1) / scale, (size.width + scale - 1) / scale, gainmap.type(), neutral);
+    auto rect = cv::Rect(at.x / scale, at.y / scale, gainmap.cols, gainmap.rows) & cv::Rect(0, 0, extended.cols, extended.rows);
+    gainmap(cv::Rect(0, 0, rect.width, rect.height)).copyTo(extended(rect));
+    vector<uchar> map;
+    imencode(".jpg", extended, map, vector<int>{cv::IMWRITE_JPEG_QUALITY, quality});
+
+    auto enc = uhdr_create_encoder();
+    uhdr_compressed_image_t base = { jpeg.data(), jpeg.size(), jpeg.size(), planes.colorGamut, UHDR_CT_SRGB, UHDR_CR_FULL_RANGE };
+    uhdr_compressed_image_t map_img = { map.data(), map.size(), map.size(), UHDR_CG_UNSPECIFIED, UHDR_CT_UNSPECIFIED, UHDR_CR_UNSPECIFIED };
+    bool encoded = checkUhdr(uhdr_enc_set_compressed_image(enc, &base, UHDR_BASE_IMG), "Set Base Image") &&
+                   checkUhdr(uhdr_enc_set_gainmap_image(enc, &map_img, &metadata), "Set Gain Map") &&
+                   checkUhdr(uhdr_encode(enc), "Encode");
+    if (encoded) {
+        auto out = uhdr_get_encoded_stream(enc);
+        jpeg.assign((char*)out->data, (char*)out->data + out->data_sz);
+    }
+    uhdr_release_encoder(enc);
+    return encoded;
+}
+
+// Every length of the frame is a fixed proportion of the main font size.
+// scaledLength() converts the length `length`, measured in pixels at the
+// reference font size, to the length at the requested one; hence scaling the
+// canvas and the font size by the same factor yields a visually identical frame.
+int scaledLength(int length, const CLIArgs &args) {
+    return (int)std::lround(length * ((double)args.fontsize / DEFAULT_FONT_SIZE));
+}
+
+// Layout of an output, which process() draws and --plan reports
+struct Frame {
+    int width, height; // of the output
+    cv::Size photo;    // once resized
+    Point at;          // top left corner of the photo
+    int footerY;       // top of the footer text
+    int mainY, subY;   // baselines of the two lines of text
+};
+
+// The frame around a photo of size `source`, scaled to fit inside it
+Frame fitFrame(cv::Size source, const CLIArgs &args) {
+    auto scaled = [&](int length) { return scaledLength(length, args); };
     int footerHeight = scaled(FOOTER_PADDING + std::max(LINE_SPACING*2,LOGO_HEIGHT));
 
-    // Size of the photo once scaled to fit inside the requested frame.
-    double scale = std::min((double)(targetW - margin*2) / sdrMat.cols, (double)(targetH - margin*2 - footerHeight) / sdrMat.rows);
-    cv::Size photo(sdrMat.cols * scale, sdrMat.rows * scale);
+    Frame frame;
+    frame.width = args.width, frame.height = args.height;
+    double scale = std::min((double)(frame.width - args.margin*2) / source.width,
+                            (double)(frame.height - args.margin*2 - footerHeight) / source.height);
+    frame.photo = cv::Size(source.width * scale, source.height * scale);
 
     // A dimension marked with `~` is only an upper bound: shrink the frame onto
     // the photo, leaving no white space in that direction. The scale is already
     // fixed by the other dimension, which may therefore still be padded.
-    if (shrink == Shrink::Width) targetW = photo.width + margin*2;
-    else if (shrink == Shrink::Height) targetH = photo.height + margin*2 + footerHeight;
+    if (args.shrink == Shrink::Width) frame.width = frame.photo.width + args.margin*2;
+    else if (args.shrink == Shrink::Height) frame.height = frame.photo.height + args.margin*2 + footerHeight;
+
+    // The photo is centered above the footer
+    frame.at = Point((frame.width - frame.photo.width) / 2,
+                     args.margin + (frame.height - args.margin*2 - footerHeight - frame.photo.height) / 2);
+    frame.footerY = frame.height - footerHeight + scaled(FOOTER_PADDING);
+    frame.mainY = frame.footerY + args.fontsize;
+    frame.subY = frame.mainY + scaled(LINE_SPACING);
+    return frame;
+}
+
+// The two lines of text on the left of the footer: the exposure, then the date
+// and the place.
+std::pair<string, string> footerText(const Metadata &meta) {
+    auto maintext = format("{} ⋅ {} ⋅ {} ⋅ {}", meta.aperture, meta.shutter, meta.focal, meta.iso);
+    auto subtext = meta.date;
+    if (meta.coordinate != "") {
+        (subtext += " ⋅ ") += meta.coordinate;
+    }
+    return {maintext, subtext};
+}
+
+// The logo in `file`, fitted into a box of `boxW` by `boxH`, as BGRA with
+// straight alpha. A drawing is rasterized straight into the box, and so stays
+// sharp at any font size, whereas a photograph of a logo has to be resampled.
+// Empty if the file cannot be read.
+Mat loadLogo(const fs::path &file, int boxW, int boxH) {
+    Mat logo = file.extension() == ".svg" ? renderSvg(file, boxW, boxH)
+                                          : cv::imread(file, cv::IMREAD_UNCHANGED);
+    if (logo.empty()) return logo;
+    if (logo.channels() < 4) cvtColor(logo, logo, logo.channels()==1 ? cv::COLOR_GRAY2BGRA : cv::COLOR_BGR2BGRA);
+
+    if (file.extension() != ".svg") {
+        auto logosize = logo.size();
+        double logoresize_ratio = std::min((double)boxH/logosize.height, (double)boxW/logosize.width);
+        resize(logo, logo, cv::Size(std::round(logosize.width*logoresize_ratio),
+                                    std::round(logosize.height*logoresize_ratio)), 0, 0, cv::INTER_AREA);
+    }
+    return logo;
+}
+
+// The camera block on the right of a footer: the logo, and the camera model and
+// the lens set against it on its left, as BGRA with straight alpha. It is the
+// same for every photo of a camera and a lens, so it is composed once per run.
+struct CameraBlock {
+    Mat pixels; // empty if the logo cannot be read, with neither model nor lens
+    // Top left corner of the block from the right edge of the frame, less the
+    // margin, on the line of the top of the footer text
+    Point offset;
+};
+
+// The camera blocks composed in this run, shared by every worker
+struct CameraBlocks {
+    std::mutex mutex;
+    // by logo file, camera model, lens, and font size
+    std::map<std::tuple<fs::path, string, string, int>, CameraBlock> blocks;
+};
+
+// Compose the camera block of the logo in `logoFile`, and of the camera model
+// and the lens of `meta`, in the colors of the two lines of text.
+CameraBlock composeCameraBlock(const fs::path &logoFile, const Metadata &meta, const CLIArgs &args,
+                               TextRenderer &fontMain, TextRenderer &fontSub, Scalar mainColor, Scalar subColor) {
+    auto scaled = [&](int length) { return scaledLength(length, args); };
+    int logoH = scaled(LOGO_HEIGHT), logoW = scaled(LOGO_WIDTH); // box the logo is fitted into
+    Mat logo = loadLogo(logoFile, logoW, logoH);
+    if (logo.empty()) return {};
+
+    // Every position below is from the right edge and the top of the text, as
+    // is the offset of the block; glyphs may reach out of their advance and of
+    // the font size, which a font size of room all around leaves space for.
+    int gap = scaled(LOGO_SPACING); // gap between the logo and the text on its left
+    int mainY = args.fontsize, subY = mainY + scaled(LINE_SPACING);
+    int camW = fontMain.width(meta.model), lensW = meta.lens.empty() ? 0 : fontSub.width(meta.lens);
+    int room = args.fontsize;
+    int left = -(logo.cols + gap + std::max(camW, lensW)) - room, top = -room;
+    int bottom = std::max((logoH - logo.rows)/2 + logo.rows, subY + room);
+
+    CameraBlock block{Mat(bottom - top, -left, CV_8UC4, Scalar::all(0)), Point(left, top)};
+    logo.copyTo(block.pixels(cv::Rect(-left - logo.cols, (logoH - logo.rows)/2 - top, logo.cols, logo.rows)));
+    int textRight = -left - logo.cols - gap; // where the text ends, in the block
+    fontMain.render(block.pixels, meta.model, Point(textRight - camW, mainY - top), mainColor);
+    if (!meta.lens.empty())
+        fontSub.render(block.pixels, meta.lens, Point(textRight - lensW, subY - top), subColor);
+    return block;
+}
+
+// The camera block of `logoFile` and of the camera and the lens of `meta`,
+// composed by the first photo to need it. Workers composing the same block at
+// once both do so, and the first to be done is kept.
+const CameraBlock &cameraBlock(CameraBlocks &cache, const fs::path &logoFile, const Metadata &meta,
+                               const CLIArgs &args, TextRenderer &fontMain, TextRenderer &fontSub,
+                               Scalar mainColor, Scalar subColor) {
+    auto key = std::tuple(logoFile, meta.model, meta.lens, args.fontsize);
+    {
+        std::lock_guard lock(cache.mutex);
+        if (auto found = cache.blocks.find(key); found != cache.blocks.end()) return found->second;
+    }
+    CameraBlock block;
+    {
+        // Allocated outside of any meter, as the block outlives the file
+        MeterScope none(nullptr);
+        block = composeCameraBlock(logoFile, meta, args, fontMain, fontSub, mainColor, subColor);
+    }
+    if (args.verbose) clog << "Composed the camera block of " << meta.model << endl;
+    // Blocks are never removed, so the one returned stays put while others are
+    // added
+    std::lock_guard lock(cache.mutex);
+    return cache.blocks.try_emplace(key, std::move(block)).first->second;
+}
 
-    // Both planes hold the same photo and have to line up, so they share its
-    // placement rather than each fitting itself into the frame.
-    auto layout = [&](const Mat& src, Mat& dst, Scalar padColor, int interp) {
-        int x = (targetW - photo.width) / 2;
-        int y = margin + (targetH - margin*2 - footerHeight - photo.height) / 2;
+// JPEG quality of the gain map of an UltraHDR output, as set by --hdr-tier
+int gainmapQuality(const CLIArgs &args) {
+    auto quality = HDR_TIERS[(int)args.hdrTier].gainmapQuality;
+    return quality ? quality : args.quality;
+}
+
+// Frame the photo read from `inputPath` into `buffer`, leaving the JPEG to save
+// to `outputPath` in `output`. The paths are for the messages only; the caller
+// does the reading and the writing, so that they overlap with the framing of
+// other files. The content of `buffer` is consumed, its storage left for reuse.
+bool process(const string &inputPath, const string &outputPath, vector<char> &buffer, vector<char> &output,
+             const CLIArgs &args, const LogoIndex &logos, CameraBlocks &blocks, Worker &worker) {
+    auto scaled = [&](int length) { return scaledLength(length, args); };
+
+    // Every buffer is freed, or given back to the pool, as soon as its last
+    // user is done with it, to keep down the memory a file needs at its peak,
+    // which the meter measures. Without a pool, the canvases and the staging
+    // buffers of the encoder are allocated afresh.
+    MemoryMeter meter;
+    MeterScope metering(&meter);
+    auto pool = args.lowMemory ? nullptr : &worker.pool;
+    auto take = [&](int rows, int cols, int type) {
+        return pool ? pool->take(rows, cols, type, meter) : Mat(rows, cols, type);
+    };
+    auto give = [&](Mat &mat) {
+        if (pool) pool->give(mat, meter);
+        else mat.release();
+    };
+
+    // 1. Read Input
+    meter.track(buffer.size());
+
+    // The frame shows a few tags, picked straight out of the EXIF segment, and
+    // the segment goes over to the output as it is, but for the size and the
+    // orientation of the image. Exiv2 decodes it only to edit it further, or to
+    // read what the fast reader cannot.
+    auto fastMeta = readExif(buffer);
+    bool editExif = !fastMeta || args.thumbnail != Thumbnail::Keep || args.stripMakerNotes;
+    Exiv2::ExifData exif;
+    std::optional<ExifSegment> rawExif;
+    if (editExif) exif = getExif(buffer);
+    else rawExif = ExifSegment::read(buffer);
+    auto meta = fastMeta ? *fastMeta : parseExif(exif);
+
+    // 2. Fit the photo into the frame, once the size of the source is known
+    Frame frame;
+    int targetW, targetH;
+    cv::Size photo;
+    Point photoAt; // top left corner of the photo in the frame
+    auto fit = [&](cv::Size source) {
+        frame = fitFrame(source, args);
+        targetW = frame.width, targetH = frame.height;
+        photo = frame.photo, photoAt = frame.at;
+    };
+
+    // A photo that needs no resizing, and whose blocks line up with those of
+    // the output, is not decoded at all with --copy-photo: its compressed
+    // blocks are copied into the output, see DctPhoto, and only the frame is
+    // compressed. Only an upright photo qualifies, as turning it would take
+    // transforming its blocks. An UltraHDR photo brings along its gain map, to
+    // be extended likewise, which takes the photo to sit on a whole pixel of
+    // the gain map.
+    PhotoPlanes planes;
+    std::optional<DctPhoto> copied;
+    Mat gainmapImage;     // of a copied UltraHDR photo
+    int gainmapScale = 1; // size of the photo over that of its gain map
+    if (args.copyPhoto && meta.orientation == 1) {
+        if (auto source = DctPhoto::open(buffer)) {
+            fit(source->size());
+            auto mcu = source->mcu();
+            if (photo == source->size() && photoAt.x % mcu.width == 0 && photoAt.y % mcu.height == 0) {
+                if (!isUhdr(buffer)) copied = std::move(source);
+                else if (gainmapImage = loadGainmap(buffer, planes); !gainmapImage.empty()) {
+                    gainmapScale = std::max(1L, std::lround((double)photo.width / gainmapImage.cols));
+                    if (photoAt.x % gainmapScale == 0 && photoAt.y % gainmapScale == 0) copied = std::move(source);
+                    else gainmapImage.release();
+                }
+            }
+        }
+        if(args.verbose) clog << (copied ? "Copying the photo as is" : "Unable to copy the photo as is") << endl;
+    }
+
+    // 3. Decode (Dual Pass if UltraHDR) & Resize, unless cached
+    //
+    // The pixels are passed through untouched, so the output must be tagged with
+    // the color space of the input; assuming sRGB would misrepresent the wider
+    // gamut of, say, a Display P3 photo. The gain map of the input is likewise
+    // reproduced for the output, see below.
+    auto cached = false;
+    // The key hashes the whole input, so it is worked out once for the size of
+    // the photo, unless decoding finds a different size from that in the header
+    string cacheKey;
+    cv::Size keyedPhoto;
+    auto cacheFile = [&] {
+        if (cacheKey.empty() || keyedPhoto != photo) {
+            cacheKey = cache_key(buffer, photo, args.resample);
+            keyedPhoto = photo;
+        }
+        return args.cache / cacheKey;
+    };
 
+    // The cache is looked up by the size of the resized photo, which is known
+    // from the header of the JPEG before decoding it. imdecode turns the photo
+    // upright, so an EXIF orientation that transposes it swaps the dimensions.
+    if (!copied && !args.cache.empty()) {
+        if (auto source = jpeg_size(buffer)) {
+            if (meta.orientation >= 5 && meta.orientation <= 8)
+                std::swap(source->width, source->height);
+            fit(*source);
+            if (auto loaded = load_planes(cacheFile())) {
+                if(args.verbose) clog << "Loaded resized planes from cache" << endl;
+                planes = std::move(*loaded);
+                cached = true;
+            }
+        }
+    }
+
+    if (!copied && !cached) {
+        if(args.verbose) clog << "Decoding SDR plane..." << endl;
+        planes.sdr = cv::imdecode(buffer, cv::IMREAD_COLOR);
+        if (planes.sdr.empty()) { cerr << "Decode failed: " << inputPath << endl; return false; }
+        fit(planes.sdr.size());
+
+        // Each plane is resized as soon as it is decoded, so that only one of
+        // them is ever held at full size. Both hold the same photo and have to
+        // line up, so they share its size rather than each fitting itself into
+        // the frame.
+        auto shrinkPlane = [&](Mat &plane) {
+            Mat resized;
+            resample(plane, resized, photo, args.resample);
+            plane = resized; // frees the full-size plane
+        };
+        shrinkPlane(planes.sdr);
+
+        if (isUhdr(buffer)) {
+            if(args.verbose) clog << "Decoding HDR plane..." << endl;
+            decodeHdr(buffer, planes);
+            if (!planes.hdr.empty()) shrinkPlane(planes.hdr);
+        }
+
+        if (!args.cache.empty()) {
+            // The HDR plane is cached in half float, and goes through it here
+            // too, for the output not to change once the photo is cached
+            if (!planes.hdr.empty()) planes.hdr.convertTo(planes.hdr, CV_16F);
+            std::error_code ec;
+            fs::create_directories(args.cache, ec);
+            if (ec || !store_planes(cacheFile(), planes))
+                cerr << "Unable to cache the planes of " << inputPath << " in " << args.cache << endl;
+        }
+    }
+    auto hasHDR = !planes.hdr.empty();
+
+    // Nothing is left to take from the input but the color profile of an SDR
+    // photo; that of an UltraHDR photo is rewritten by the encoder. A copied
+    // photo is still to be read from the input, and keeps its profile.
+    vector<uint8_t> icc;
+    if (!hasHDR) icc = getIcc(buffer);
+    auto releaseInput = [&] {
+        meter.untrack(buffer.size());
+        if (pool) buffer.clear();
+        else vector<char>().swap(buffer);
+    };
+    if (!copied) releaseInput();
+
+    // 4. Pad
+    auto layout = [&](const Mat& resized, Mat& dst, Scalar padColor) {
         dst.setTo(padColor);
-        Mat resized;
-        resize(src, resized, photo, 0, 0, interp);
-        resized.copyTo(dst(cv::Rect(x, y, photo.width, photo.height)));
+        // With the cache on, the HDR plane is half float, converted on the way
+        resized.convertTo(dst(cv::Rect(photoAt, photo)), dst.depth());
     };
 
-    Mat sdrCanvas(targetH, targetW, CV_8UC3);
-    layout(sdrMat, sdrCanvas, Scalar(255, 255, 255), cv::INTER_LANCZOS4);
+    // A copied photo is only set in while compressing, the canvas holds the
+    // frame alone
+    Mat sdrCanvas = take(targetH, targetW, CV_8UC3);
+    if (copied) sdrCanvas.setTo(Scalar(255, 255, 255));
+    else layout(planes.sdr, sdrCanvas, Scalar(255, 255, 255));
 
     Mat hdrCanvas;
     if (hasHDR) {
-        hdrCanvas.create(targetH, targetW, CV_32FC3);
+        hdrCanvas = take(targetH, targetW, CV_32FC3);
         // Pad with 1.0 (SDR White in Linear HDR)
-        layout(hdrMat, hdrCanvas, Scalar(1.0f, 1.0f, 1.0f), cv::INTER_LANCZOS4);
+        layout(planes.hdr, hdrCanvas, Scalar(1.0f, 1.0f, 1.0f));
     }
 
-    // 4. Draw Metadata
-    auto meta = parseExif(exif);
-    TextRenderer fontMain(BOLD_FONTS, fontSize);
-    TextRenderer fontSub(REGULAR_FONTS, scaled(SUB_FONT_SIZE));
-
-    auto maintext = format("{} ⋅ {} ⋅ {} ⋅ {}", meta.aperture, meta.shutter, meta.focal, meta.iso);
-    auto subtext = meta.date;
-    if (meta.coordinate != "") {
-        (subtext += " ⋅ ") += meta.coordinate;
+    // The photo is on the canvases now
+    planes.sdr.release();
+    planes.hdr.release();
+    planes.storage.reset();
+
+    // 5. Draw Metadata
+    if (!worker.fontMain) {
+        auto started = std::chrono::steady_clock::now();
+        worker.fontMain.emplace(BOLD_FONTS, args.fontsize);
+        worker.fontSub.emplace(REGULAR_FONTS, scaled(SUB_FONT_SIZE));
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+        if (args.verbose) clog << format("Fonts loaded in {:.1f} ms", elapsed.count()) << endl;
     }
-    int footerY = targetH - footerHeight + scaled(FOOTER_PADDING); // top of the text
-    int mainY = footerY + fontSize;              // baseline of the main text
-    int subY = mainY + scaled(LINE_SPACING);     // baseline of the sub text
+    auto &fontMain = *worker.fontMain, &fontSub = *worker.fontSub;
+
+    auto [maintext, subtext] = footerText(meta);
+    int footerY = frame.footerY, mainY = frame.mainY, subY = frame.subY;
 
     // SDR Colors
     Scalar sdrText(0,0,0);
     Scalar sdrSub(100,100,100);
 
-    // HDR Colors (Linear)
-    // Black is 0. Gray #666 (0.4 sRGB) is approx 0.133 Linear
-    Scalar hdrText(0,0,0);
-    Scalar hdrSub(0.133, 0.133, 0.133);
+    // HDR Colors (Linear), those of SDR through the curve the camera block is
+    // blended with, so that both lines of text are the same gray
+    auto linear = [](Scalar srgb) {
+        return Scalar(LINEAR_LEVELS[(int)srgb[0]], LINEAR_LEVELS[(int)srgb[1]], LINEAR_LEVELS[(int)srgb[2]]);
+    };
+    Scalar hdrText = linear(sdrText);
+    Scalar hdrSub = linear(sdrSub);
 
     // Draw SDR
-    fontMain.render(sdrCanvas, maintext, Point(margin, mainY), sdrText);
-    fontSub.render(sdrCanvas, subtext, Point(margin, subY), sdrSub);
+    fontMain.render(sdrCanvas, maintext, Point(args.margin, mainY), sdrText);
+    fontSub.render(sdrCanvas, subtext, Point(args.margin, subY), sdrSub);
 
     // Draw HDR
     if (hasHDR) {
-        fontMain.render(hdrCanvas, maintext, Point(margin, mainY), hdrText);
-        fontSub.render(hdrCanvas, subtext, Point(margin, subY), hdrSub);
+        fontMain.render(hdrCanvas, maintext, Point(args.margin, mainY), hdrText);
+        fontSub.render(hdrCanvas, subtext, Point(args.margin, subY), hdrSub);
     }
 
     // Logos
-    auto logoPath = get_executable_directory();
-    if (fs::is_directory(logoPath / "../share/hiframe/logo")) logoPath /= "../share/hiframe/logo";
-    else if (is_directory(logoPath / "logo")) logoPath /= "logo";
-    else if (fs::is_directory(logoPath / "../logo")) logoPath /= "../logo";
-    else cerr << "Unable to find logo images" << endl;
-
-    auto logoFile = findLogo(logoPath, meta.make, meta.taken);
+    auto logoFile = findLogo(logos, meta.make, meta.taken);
     if (logoFile.empty()) {
         cerr << "Unknown manufacture: " << meta.make << "; fallback to default logo" << endl;
-        logoFile = logoPath / "default.svg";
-        if (!fs::exists(logoFile)) logoFile = logoPath / "default.png";
+        logoFile = logos.fallback;
     }
-    if (verbose) clog << "Logo: " << logoFile.filename() << endl;
+    if (args.verbose) clog << "Logo: " << logoFile.filename() << endl;
 
-    int logoH = scaled(LOGO_HEIGHT), logoW = scaled(LOGO_WIDTH); // box the logo is fitted into
-
-    // A drawing is rasterized straight into the box, and so stays sharp at any
-    // font size, whereas a photograph of a logo has to be resampled.
-    Mat logo = logoFile.extension() == ".svg" ? renderSvg(logoFile, logoW, logoH)
-                                              : cv::imread(logoFile, cv::IMREAD_UNCHANGED);
-    if (!logo.empty()) {
-        if (logo.channels() < 4) cvtColor(logo, logo, logo.channels()==1 ? cv::COLOR_GRAY2BGRA : cv::COLOR_BGR2BGRA);
-
-        if (logoFile.extension() != ".svg") {
-            auto logosize = logo.size();
-            double logoresize_ratio = std::min((double)logoH/logosize.height, (double)logoW/logosize.width);
-            resize(logo, logo, cv::Size(std::round(logosize.width*logoresize_ratio),
-                                        std::round(logosize.height*logoresize_ratio)), 0, 0, cv::INTER_AREA);
-        }
-
-        int hsize = logo.cols, vsize = logo.rows;
-        int lx = targetW - margin - hsize;
-        int ly = footerY + (logoH-vsize)/2;
+    // The block is laid over the canvases, the rows shared out over the threads
+    // of this file
+    auto &block = cameraBlock(blocks, logoFile, meta, args, fontMain, fontSub, sdrText, sdrSub);
+    auto at = Point(targetW - args.margin, footerY) + block.offset;
+    auto area = cv::Rect(at, block.pixels.size()) & cv::Rect(0, 0, targetW, targetH);
+    if (!area.empty()) {
+        Mat pixels = block.pixels(cv::Rect(area.tl() - at, area.size()));
 
         // Blend SDR
-        for(int r=0; r<logo.rows; r++) {
-            for(int c=0; c<logo.cols; c++) {
-                cv::Vec4b p = logo.at<cv::Vec4b>(r,c);
-                float a = p[3]/255.f;
-                if(a>0) {
-                    cv::Vec3b& b = sdrCanvas.at<cv::Vec3b>(ly+r, lx+c);
-                    for(int k=0;k<3;k++) b[k] = cv::saturate_cast<uchar>(b[k]*(1-a) + p[k]*a);
+        cv::parallel_for_(cv::Range(0, pixels.rows), [&](const cv::Range &rows) {
+            for(int r=rows.start; r<rows.end; r++) {
+                for(int c=0; c<pixels.cols; c++) {
+                    cv::Vec4b p = pixels.at<cv::Vec4b>(r,c);
+                    float a = p[3]/255.f;
+                    if(a>0) {
+                        cv::Vec3b& b = sdrCanvas.at<cv::Vec3b>(area.y+r, area.x+c);
+                        for(int k=0;k<3;k++) b[k] = cv::saturate_cast<uchar>(b[k]*(1-a) + p[k]*a);
+                    }
                 }
             }
-        }
+        });
 
         // Blend HDR (Linear)
         if (hasHDR) {
-            for(int r=0; r<logo.rows; r++) {
-                for(int c=0; c<logo.cols; c++) {
-                    cv::Vec4b p = logo.at<cv::Vec4b>(r,c);
-                    float a = p[3]/255.f;
-                    if(a>0) {
-                        cv::Vec3f& b = hdrCanvas.at<cv::Vec3f>(ly+r, lx+c);
-                        for(int k=0;k<3;k++) {
-                            // Convert logo sRGB to Linear: pow(x/255, 2.2)
-                            float val = pow(p[k]/255.f, 2.2f);
-                            b[k] = b[k]*(1-a) + val*a;
+            cv::parallel_for_(cv::Range(0, pixels.rows), [&](const cv::Range &rows) {
+                for(int r=rows.start; r<rows.end; r++) {
+                    for(int c=0; c<pixels.cols; c++) {
+                        cv::Vec4b p = pixels.at<cv::Vec4b>(r,c);
+                        float a = p[3]/255.f;
+                        if(a>0) {
+                            cv::Vec3f& b = hdrCanvas.at<cv::Vec3f>(area.y+r, area.x+c);
+                            for(int k=0;k<3;k++) b[k] = b[k]*(1-a) + LINEAR_LEVELS[p[k]]*a;
                         }
                     }
                 }
-            }
-        }
-
-        int gap = scaled(LOGO_SPACING); // gap between the logo and the text on its left
-
-        string cam = meta.model;
-        int w = fontMain.width(cam);
-        fontMain.render(sdrCanvas, cam, Point(lx - gap - w, mainY), sdrText);
-        if (hasHDR) fontMain.render(hdrCanvas, cam, Point(lx - gap - w, mainY), hdrText);
-
-        if(!meta.lens.empty()) {
-            int w2 = fontSub.width(meta.lens);
-            fontSub.render(sdrCanvas, meta.lens, Point(lx - gap - w2, subY), sdrSub);
-            if(hasHDR) fontSub.render(hdrCanvas, meta.lens, Point(lx - gap - w2, subY), hdrSub);
+            });
         }
     }
 
-    // 5. Encode (Raw SDR + Raw HDR)
-    if(verbose) clog << "Encoding..." << endl;
+    // 6. Encode (Raw SDR + Raw HDR)
+    if(args.verbose) clog << "Encoding..." << endl;
 
     // update some EXIF data regarding the new image.
-    if (!exif.empty()) {
+    vector<uint8_t> exifSegment;
+    if (rawExif) {
+        rawExif->patch(targetW, targetH);
+        exifSegment = rawExif->bytes();
+    } else if (!exif.empty()) {
         using namespace Exiv2;
         if (auto key = exif.findKey(ExifKey("Exif.Image.Orientation")); key != exif.end())
         exif.erase(key);
@@ -431,41 +905,77 @@ bool process(const string &inputPath, const string &outputPath, int quality, int
             *key = targetW;
         if (auto key = exif.findKey(ExifKey("Exif.Image.ImageLength")); key != exif.end())
             *key = targetH;
+
+        // The thumbnail of the input shows the photo unframed
+        ExifThumb thumb(exif);
+        if (args.thumbnail == Thumbnail::Strip) thumb.erase();
+        else if (args.thumbnail == Thumbnail::Regenerate) {
+            auto jpeg = makeThumbnail(sdrCanvas, copied ? &buffer : nullptr, cv::Rect(photoAt, photo));
+            thumb.setJpegThumbnail(jpeg.data(), jpeg.size());
+        }
+        if (args.stripMakerNotes) pruneMakerNotes(exif);
+
+        // The EXIF data encoded by Exiv 2 lacks header, so add it back; should
+        // Exiv2 fail, the output goes without it.
+        try {
+            vector<uint8_t> encoded;
+            ExifParser::encode(encoded, littleEndian, exif);
+            exifSegment.assign({'E', 'x', 'i', 'f', 0, 0});
+            exifSegment.insert(exifSegment.end(), encoded.begin(), encoded.end());
+        } catch(...) { exifSegment.clear(); }
     }
 
     if (hasHDR) {
-        // Prepare Raw Images
+        // Prepare Raw Images, each canvas given up as soon as it is converted
         // SDR: Convert BGR to RGBA
-        Mat sdrRaw; cvtColor(sdrCanvas, sdrRaw, cv::COLOR_BGR2RGBA);
-
-        // HDR: Convert BGR Linear Float to RGBA Half Float (16F)
-        Mat hdrLinear; cvtColor(hdrCanvas, hdrLinear, cv::COLOR_BGR2RGBA);
-        Mat hdrHalf; hdrLinear.convertTo(hdrHalf, CV_16F);
+        Mat sdrRaw = take(targetH, targetW, CV_8UC4);
+        cvtColor(sdrCanvas, sdrRaw, cv::COLOR_BGR2RGBA);
+        give(sdrCanvas);
+
+        // HDR: Convert BGR Linear Float to RGBA Half Float (16F), through a few
+        // rows of RGBA 32F at a time rather than a full copy of the canvas
+        Mat hdrHalf = take(targetH, targetW, CV_16FC4);
+        cv::parallel_for_(cv::Range(0, targetH), [&](const cv::Range &rows) {
+            constexpr int BAND = 64;
+            Mat hdrLinear;
+            for (int r = rows.start; r < rows.end; r += BAND) {
+                cv::Range band(r, std::min(r + BAND, rows.end));
+                cvtColor(hdrCanvas.rowRange(band), hdrLinear, cv::COLOR_BGR2RGBA);
+                hdrLinear.convertTo(hdrHalf.rowRange(band), CV_16F);
+            }
+        });
+        give(hdrCanvas);
 
         auto enc = uhdr_create_encoder();
 
-        uhdr_raw_image_t sdr_img = { UHDR_IMG_FMT_32bppRGBA8888, colorGamut, UHDR_CT_SRGB, UHDR_CR_FULL_RANGE,
+        uhdr_raw_image_t sdr_img = { UHDR_IMG_FMT_32bppRGBA8888, planes.colorGamut, UHDR_CT_SRGB, UHDR_CR_FULL_RANGE,
                                      (unsigned)sdrRaw.cols, (unsigned)sdrRaw.rows };
         sdr_img.planes[UHDR_PLANE_PACKED] = sdrRaw.data;
         sdr_img.stride[UHDR_PLANE_PACKED] = sdrRaw.cols; // Stride in pixels
 
-        uhdr_raw_image_t hdr_img = { UHDR_IMG_FMT_64bppRGBAHalfFloat, colorGamut, UHDR_CT_LINEAR, UHDR_CR_FULL_RANGE,
+        uhdr_raw_image_t hdr_img = { UHDR_IMG_FMT_64bppRGBAHalfFloat, planes.colorGamut, UHDR_CT_LINEAR, UHDR_CR_FULL_RANGE,
                                      (unsigned)hdrHalf.cols, (unsigned)hdrHalf.rows };
         hdr_img.planes[UHDR_PLANE_PACKED] = hdrHalf.data;
         hdr_img.stride[UHDR_PLANE_PACKED] = hdrHalf.cols;
 
         checkUhdr(uhdr_enc_set_raw_image(enc, &sdr_img, UHDR_SDR_IMG), "Set SDR");
         checkUhdr(uhdr_enc_set_raw_image(enc, &hdr_img, UHDR_HDR_IMG), "Set HDR");
-        checkUhdr(uhdr_enc_set_quality(enc, quality, UHDR_BASE_IMG), "Set Base Quality");
-        checkUhdr(uhdr_enc_set_quality(enc, quality, UHDR_GAIN_MAP_IMG), "Set Gain Map Quality");
+        // The preset goes first, for the settings made after it to hold
+        auto &tier = HDR_TIERS[(int)args.hdrTier];
+        if (tier.preset) checkUhdr(uhdr_enc_set_preset(enc, *tier.preset), "Set Preset");
+        checkUhdr(uhdr_enc_set_quality(enc, args.quality, UHDR_BASE_IMG), "Set Base Quality");
+        if (tier.gainmapScale) checkUhdr(uhdr_enc_set_gainmap_scale_factor(enc, tier.gainmapScale), "Set Gain Map Scale");
+        if (tier.gainmapGamma) checkUhdr(uhdr_enc_set_gainmap_gamma(enc, tier.gainmapGamma), "Set Gain Map Gamma");
+        checkUhdr(uhdr_enc_set_quality(enc, gainmapQuality(args), UHDR_GAIN_MAP_IMG), "Set Gain Map Quality");
 
         // The gain map is regenerated from the two planes, and by default for a
         // 10000 nit display. A display applies the map weighted by
         // log2(headroom)/log2(hdr_capacity_max), so leaving that default in place
         // dims the highlights of an input mastered for a dimmer display. Ask for
         // the gain map the input was written with instead.
-        checkUhdr(uhdr_enc_set_using_multi_channel_gainmap(enc, multiChannelGainmap), "Set Gain Map Channels");
-        if (hasGainmap) {
+        checkUhdr(uhdr_enc_set_using_multi_channel_gainmap(enc, planes.multiChannelGainmap), "Set Gain Map Channels");
+        if (planes.gainmap) {
+            auto &gainmap = *planes.gainmap;
             auto peak = std::clamp(gainmap.hdr_capacity_max * SDR_WHITE_NITS, MIN_PEAK_NITS, MAX_PEAK_NITS);
             checkUhdr(uhdr_enc_set_target_display_peak_brightness(enc, peak), "Set Peak Brightness");
             // The boosts are per channel, the encoder takes one range for all of
@@ -476,70 +986,318 @@ bool process(const string &inputPath, const string &outputPath, int quality, int
                       "Set Content Boost");
         }
 
-        vector<uint8_t> exif_raw;
-        if (!exif.empty()) {
-            vector<uint8_t> exif_raw0;
-            Exiv2::ExifParser::encode(exif_raw0, Exiv2::littleEndian, exif);
-
-            // The EXIF data encoded by Exiv 2 lacks header, so add it back.
-            exif_raw.resize(exif_raw0.size()+6);
-            memcpy(exif_raw.data(), "Exif\0", 6);
-            memcpy(exif_raw.data()+6, exif_raw0.data(), exif_raw0.size());
-
-            uhdr_mem_block_t eb = { exif_raw.data(), exif_raw.size(), exif_raw.size() };
+        if (!exifSegment.empty()) {
+            uhdr_mem_block_t eb = { exifSegment.data(), exifSegment.size(), exifSegment.size() };
             checkUhdr(uhdr_enc_set_exif_data(enc, &eb), "Set EXIF");
         }
 
-        if (checkUhdr(uhdr_encode(enc), "Encode")) {
+        auto started = std::chrono::steady_clock::now();
+        bool encoded = checkUhdr(uhdr_encode(enc), "Encode");
+        if (encoded) {
             auto out = uhdr_get_encoded_stream(enc);
-            ofstream f(outputPath, ios::binary);
-            f.write((char*)out->data, out->data_sz);
-            if(verbose) clog << "Saved UltraHDR: " << outputPath << endl;
+            output.assign((char*)out->data, (char*)out->data + out->data_sz);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+            if(args.verbose) clog << format("Encoded UltraHDR: {} ({:.0f} KiB in {:.1f} ms, PSNR {:.2f} dB)", outputPath,
+                                            output.size() / 1024.0, elapsed.count(), hdrPsnr(output, hdrHalf)) << endl;
         }
         uhdr_release_encoder(enc);
+        give(sdrRaw);
+        give(hdrHalf);
+        if (!encoded) return false;
     } else {
         // Standard JPEG
         vector<uchar> buf;
-        vector<int> p = {cv::IMWRITE_JPEG_QUALITY, quality};
-        imencode(".jpg", sdrCanvas, buf, p);
-        ofstream f(outputPath, ios::binary);
-        f.write((char*)buf.data(), buf.size());
-        f.close();
-
-        try {
-            Exiv2::Image::AutoPtr dst = Exiv2::ImageFactory::open(outputPath); dst->readMetadata();
-            dst->setExifData(exif);
-            // Carry over the color space, as the pixels are left untouched
-            if (auto icc = getIcc(buffer); !icc.empty()) {
-                Exiv2::DataBuf profile(icc.data(), icc.size());
-                dst->setIccProfile(profile);
-            }
-            dst->writeMetadata();
-        } catch(...) {}
-        if(verbose) clog << "Saved SDR: " << outputPath << endl;
+        if (copied) {
+            auto composed = copied->compose(sdrCanvas, photoAt, buf);
+            give(sdrCanvas);
+            copied.reset();
+            releaseInput();
+            if (!composed) return false;
+        } else {
+            // Compressed in strips over the threads of this file
+            auto encoded = encode_jpeg(sdrCanvas, args.quality, buf);
+            give(sdrCanvas);
+            if (!encoded) return false;
+        }
+        // The metadata goes in before the JPEG leaves memory, the color profile
+        // carried over as the pixels are left untouched.
+        insert_metadata(buf, exifSegment, icc);
+        output.assign(buf.begin(), buf.end());
+
+        if (!gainmapImage.empty()) {
+            if (!appendGainmap(output, gainmapImage, photoAt, gainmapScale, cv::Size(targetW, targetH), planes, gainmapQuality(args)))
+                return false;
+            if(args.verbose) clog << "Encoded UltraHDR: " << outputPath << endl;
+        } else if(args.verbose) clog << "Encoded SDR: " << outputPath << endl;
     }
 
+    if(args.verbose) clog << format("Peak memory: {:.1f} MiB", meter.peak() / 1048576.0) << endl;
     return true;
 }
 
+// Print the layout of the output of each input as a line of JSON, worked out
+// from the header and the EXIF data of the input alone: no pixel is decoded, and
+// only the start of the file is read. Along with the size of the output, the
+// place of the photo, the logo and the text of the footer, a record warns of
+// what would spoil the frame: a manufacturer without a logo, and text running
+// into the camera block on the right. Returns the exit status.
+int planLayouts(const CLIArgs &args, const LogoIndex &logos) {
+    auto scaled = [&](int length) { return scaledLength(length, args); };
+    TextRenderer fontMain(BOLD_FONTS, args.fontsize), fontSub(REGULAR_FONTS, scaled(SUB_FONT_SIZE));
+    int logoH = scaled(LOGO_HEIGHT), logoW = scaled(LOGO_WIDTH), gap = scaled(LOGO_SPACING);
+    std::map<fs::path, cv::Size> logoSizes; // a run uses a few logos, each loaded once
+
+    int status = 0, warned = 0;
+    vector<char> buffer;
+    for (auto &[input, output] : args.files) {
+        auto record = format("{{\"input\":{},\"output\":{}", json_string(input.string()), json_string(output.string()));
+        auto fail = [&](const string &error) {
+            std::cout << record << ",\"error\":" << json_string(error) << "}\n";
+            status = 1;
+        };
+
+        // The EXIF segment and the frame header come first in a JPEG, and
+        // mostly within its first 64 KiB; more is read only when they are not.
+        std::optional<cv::Size> source;
+        std::error_code ec;
+        for (size_t head = 64 << 10; !source; head *= 4) {
+            if ((ec = read_file(input, buffer, head))) break;
+            source = jpeg_size(buffer);
+            if (buffer.size() < head) break; // the whole file
+        }
+        if (ec) { fail(ec.message()); continue; }
+        if (!source) { fail("not a JPEG photo"); continue; }
+
+        // Exiv2 reads the metadata of a JPEG up to its scan, so needs the file
+        Metadata meta;
+        if (auto fastMeta = readExif(buffer)) meta = *fastMeta;
+        else {
+            if ((ec = read_file(input, buffer))) { fail(ec.message()); continue; }
+            try {
+                meta = parseExif(getExif(buffer));
+            } catch (const std::exception &e) { fail(e.what()); continue; }
+        }
+
+        // imdecode turns the photo upright
+        if (meta.orientation >= 5 && meta.orientation <= 8)
+            std::swap(source->width, source->height);
+        auto frame = fitFrame(*source, args);
+        if (frame.photo.width <= 0 || frame.photo.height <= 0) { fail("no room left for the photo"); continue; }
+
+        vector<string> warnings;
+        auto logoFile = findLogo(logos, meta.make, meta.taken);
+        if (logoFile.empty()) {
+            warnings.push_back(format("unknown manufacturer \"{}\", the default logo is used", meta.make));
+            logoFile = logos.fallback;
+        }
+        auto logo = logoSizes.find(logoFile);
+        if (logo == logoSizes.end())
+            logo = logoSizes.emplace(logoFile, loadLogo(logoFile, logoW, logoH).size()).first;
+
+        // The text on the left ends where the camera model and the lens, set
+        // flush against the logo, begin
+        auto [maintext, subtext] = footerText(meta);
+        if (logo->second.empty()) warnings.push_back("unreadable logo, the camera and the lens are left out");
+        else {
+            int lx = frame.width - args.margin - logo->second.width;
+            if (args.margin + fontMain.width(maintext) > lx - gap - fontMain.width(meta.model))
+                warnings.push_back("the main text runs into the camera model");
+            if (args.margin + fontSub.width(subtext) > lx - gap - (meta.lens.empty() ? 0 : fontSub.width(meta.lens)))
+                warnings.push_back("the sub text runs into the lens");
+        }
+
+        record += format(",\"width\":{},\"height\":{},\"photo\":{{\"x\":{},\"y\":{},\"width\":{},\"height\":{}}}",
+                         frame.width, frame.height, frame.at.x, frame.at.y, frame.photo.width, frame.photo.height);
+        record += format(",\"logo\":{},\"make\":{},\"model\":{},\"lens\":{},\"main\":{},\"sub\":{},\"warnings\":[",
+                         json_string(logoFile.filename().string()), json_string(meta.make), json_string(meta.model),
+                         json_string(meta.lens), json_string(maintext), json_string(subtext));
+        for (size_t i = 0; i < warnings.size(); i++)
+            (record += i ? "," : "") += json_string(warnings[i]);
+        std::cout << record << "]}\n";
+        warned += !warnings.empty();
+    }
+
+    if (args.verbose) clog << format("Planned {} file(s), {} with warnings", args.files.size(), warned) << endl;
+    return status;
+}
+
 int main(int argc, char** argv) {
+    // Starting up weighs on a run framing a single photo, so its phases are
+    // timed, for --verbose. Before main(), the libraries are loaded and their
+    // static objects constructed, which is taken as the CPU time spent by then.
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    auto milliseconds = [](const timeval &t) { return t.tv_sec * 1e3 + t.tv_usec / 1e3; };
+    auto loading = milliseconds(usage.ru_utime) + milliseconds(usage.ru_stime);
+    auto lap = [last = std::chrono::steady_clock::now()]() mutable {
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::milli> elapsed = now - last;
+        last = now;
+        return elapsed.count();
+    };
+
     auto args_op = parse_arguments(argc, argv);
-    bool has_failure = false;
+    auto parsing = lap();
+    std::atomic<bool> has_failure = false;
 
     if (std::holds_alternative<int>(args_op))
         return std::get<int>(args_op);
     auto args = std::get<CLIArgs>(args_op);
 
-    for (auto &file: args.files) {
-        if (auto ec = create_parent_directory(file.second)) {
-            cerr << "Unable to create directory " << file.second.parent_path() << ": " << ec.message() << endl;
-            has_failure = true;
-            continue;
-        }
+    if (!args.merge.empty()) {
+        vector<fs::path> inputs;
+        for (auto &file : args.files) inputs.push_back(file.first);
+        return merge_manifests(args.merge, inputs);
+    }
 
-        if (!process(file.first, file.second, args.quality, args.width, args.height, args.shrink, args.fontsize, args.margin, args.verbose))
-            has_failure = true;
+    // Each input is recorded with the time from when a worker took it up to
+    // when its output was written, or it failed
+    Manifest manifest;
+    if (!args.manifest.empty() && !manifest.open(args.manifest)) return 1;
+    auto record = [&](const fs::path &input, const fs::path &output, std::chrono::steady_clock::time_point started,
+                      bool framed) {
+        if (args.manifest.empty()) return;
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+        manifest.record(input, output, framed, elapsed.count());
+    };
+
+    install_metered_allocator();
+    auto logos = indexLogos();
+    CameraBlocks blocks;
+    if (args.verbose)
+        clog << format("Startup: {:.1f} ms loading, {:.1f} ms arguments, {:.1f} ms logos", loading, parsing, lap()) << endl;
+
+    if (!args.watch.empty()) {
+        // Photos arrive one at a time, each of which wants to be framed as soon
+        // as possible, so each gets every thread, by the one worker.
+        apply_thread_budget(plan_threads(args.threads, 1));
+
+        Worker worker;
+        // Outputs written into the watched directory itself, which are not to
+        // be framed again when they land there. Each arrives once, and is then
+        // forgotten, so that a long watch does not pile them up.
+        std::set<fs::path> outputs;
+        // Directory `file` is in, resolved, empty if that fails
+        auto directory = [](const fs::path &file) {
+            std::error_code ec;
+            auto dir = fs::weakly_canonical(fs::absolute(file, ec).parent_path(), ec);
+            return ec ? fs::path() : dir;
+        };
+        return watch_directory(args.watch, [&](const fs::path &input) {
+            if (outputs.erase(input)) return;
+            // Machines watching the same directory share out its photos
+            if (!in_shard(input, args.shardIndex, args.shardCount)) return;
+            auto output = format_output(input, args.outputPattern);
+            // Named as the watch names what arrives; should either directory
+            // fail to resolve, the output is taken to land there all the same.
+            auto landing = input.parent_path() / output.filename();
+            auto inputDir = directory(input), outputDir = directory(output);
+            bool lands = inputDir.empty() || outputDir.empty() || inputDir == outputDir;
+            if (lands) outputs.insert(landing);
+
+            auto started = std::chrono::steady_clock::now();
+            // A garbled photo may throw out of Exiv2, OpenCV or FreeType; it
+            // fails alone, and the watch goes on.
+            auto ok = [&] {
+                try {
+                    vector<char> buffer, framed;
+                    if (auto ec = read_file(input, buffer)) {
+                        cerr << "File error: " << input.string() << ": " << ec.message() << endl;
+                        return false;
+                    }
+                    if (auto ec = create_parent_directory(output)) {
+                        cerr << "Unable to create directory " << output.parent_path() << ": " << ec.message() << endl;
+                        return false;
+                    }
+                    if (!process(input, output, buffer, framed, args, logos, blocks, worker)) return false;
+                    if (auto ec = write_file(output, framed)) {
+                        cerr << "Unable to write " << output << ": " << ec.message() << endl;
+                        return false;
+                    }
+                    return true;
+                } catch (const std::exception &e) {
+                    cerr << "Unable to frame " << input.string() << ": " << e.what() << endl;
+                    return false;
+                }
+            }();
+            if (ok) clog << "Framed " << input << endl;
+            else if (lands) outputs.erase(landing); // nothing to arrive
+            record(input, output, started, ok);
+        });
+    }
+
+    // Each machine of a sharded run takes its share of the inputs
+    if (args.shardCount > 1) {
+        auto total = args.files.size();
+        std::erase_if(args.files, [&](auto &file) { return !in_shard(file.first, args.shardIndex, args.shardCount); });
+        if (args.verbose)
+            clog << format("Shard {}/{}: {} of {} input(s)", args.shardIndex, args.shardCount, args.files.size(), total) << endl;
+    }
+
+    if (args.plan) return planLayouts(args, logos);
+
+    auto budget = plan_threads(args.threads, args.files.size());
+    apply_thread_budget(budget);
+
+    // The files are handed out in order, so reading a couple of them ahead per
+    // worker keeps every worker fed; the outputs are written behind them. Each
+    // input read ahead costs its size in memory, so keep to one with
+    // --low-memory.
+    vector<fs::path> inputs;
+    for (auto &file : args.files) inputs.push_back(file.first);
+    AsyncIO io(std::move(inputs), args.lowMemory ? 1 : 2 * budget.workers);
+
+    if (args.verbose) {
+        clog << format("Threads: {} file(s) at once, {} thread(s) each", budget.workers, budget.intra) << endl;
+        clog << "I/O: " << io.backend() << endl;
+        clog << format("Threads and I/O set up in {:.1f} ms", lap()) << endl;
     }
 
+    run_parallel(args.files.size(), budget.workers, [&](size_t i) {
+        auto &file = args.files[i];
+        auto started = std::chrono::steady_clock::now();
+        // Every file goes into the manifest once: here if it fails, otherwise
+        // when its output is written, so that the manifest of a shard is
+        // always complete.
+        bool recorded = false;
+        auto fail = [&] {
+            has_failure = true;
+            recorded = true;
+            record(file.first, file.second, started, false);
+        };
+
+        // A garbled photo may throw out of Exiv2, OpenCV or FreeType; it fails
+        // alone, as in a watch, and the outputs queued to be written still are.
+        try {
+            auto buffer = io.read(i);
+            if (!buffer) {
+                fail();
+                return;
+            }
+            if (auto ec = create_parent_directory(file.second)) {
+                cerr << "Unable to create directory " << file.second.parent_path() << ": " << ec.message() << endl;
+                fail();
+                return;
+            }
+
+            // Buffers and fonts are kept from one file to the next of the same worker
+            static thread_local Worker worker;
+            vector<char> output;
+            if (process(file.first, file.second, *buffer, output, args, logos, blocks, worker)) {
+                io.write(file.second, std::move(output), [&, i, started](bool written) {
+                    record(args.files[i].first, args.files[i].second, started, written);
+                });
+                recorded = true;
+            } else
+                fail();
+            if (!args.lowMemory) io.recycle(std::move(*buffer));
+        } catch (const std::exception &e) {
+            cerr << "Unable to frame " << file.first.string() << ": " << e.what() << endl;
+            if (!recorded) fail();
+        }
+    });
+
+    if (!io.flush()) has_failure = true;
+    if (args.verbose) clog << format("Framed and written in {:.1f} ms", lap()) << endl;
     return has_failure? 1:0;
 }
@@ -0,0 +1,125 @@
+// memory.cxx
+// Copyright (c) 2025, 张子辰
+
+// This file is part of HDR Image Frame.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+
+#include "memory.hxx"
+
+namespace {
+
+thread_local MemoryMeter *installed = nullptr;
+
+// Wraps the standard allocator of OpenCV, tagging each allocation with the
+// meter of the thread making it, so that it is credited back to that meter
+// when freed.
+class MeteredAllocator : public cv::MatAllocator {
+    const cv::MatAllocator *base = cv::Mat::getStdAllocator();
+
+public:
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                           cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override {
+        auto u = base->allocate(dims, sizes, type, data, step, flags, usageFlags);
+        if (!u) return u;
+        // Freeing goes through the allocator of the data, so claim it back
+        u->currAllocator = this;
+        // Memory owned by someone else, as wrapped by Mat(rows, cols, type, data),
+        // is not allocated here, nor freed.
+        if (!data && installed) {
+            u->userdata = installed;
+            installed->track(u->size);
+        }
+        return u;
+    }
+
+    bool allocate(cv::UMatData* u, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override {
+        return base->allocate(u, flags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData* u) const override {
+        if (!u) return;
+        if (auto meter = static_cast<MemoryMeter*>(u->userdata)) meter->untrack(u->size);
+        u->userdata = nullptr;
+        u->currAllocator = base;
+        base->deallocate(u);
+    }
+};
+
+}
+
+void MemoryMeter::track(std::size_t bytes) {
+    auto now = current += bytes;
+    for (auto peak = highest.load(); now > peak && !highest.compare_exchange_weak(peak, now); );
+}
+
+void MemoryMeter::untrack(std::size_t bytes) {
+    current -= bytes;
+}
+
+MeterScope::MeterScope(MemoryMeter *meter) : previous(installed) {
+    installed = meter;
+}
+
+MeterScope::~MeterScope() {
+    installed = previous;
+}
+
+void install_metered_allocator() {
+    static MeteredAllocator allocator;
+    cv::Mat::setDefaultAllocator(&allocator);
+}
+
+cv::Mat MatPool::take(int rows, int cols, int type, MemoryMeter &meter) {
+    auto match = std::find_if(idle.begin(), idle.end(), [&](const cv::Mat &mat) {
+        return mat.rows == rows && mat.cols == cols && mat.type() == type;
+    });
+
+    cv::Mat mat;
+    if (match != idle.end()) {
+        mat = std::move(*match);
+        idle.erase(match);
+    } else {
+        // Allocated outside of any meter, as the memory outlives the file
+        MeterScope none(nullptr);
+        mat.create(rows, cols, type);
+    }
+    meter.track(mat.total() * mat.elemSize());
+    return mat;
+}
+
+void MatPool::give(cv::Mat &mat, MemoryMeter &meter) {
+    if (mat.empty()) return;
+    meter.untrack(mat.total() * mat.elemSize());
+
+    // A Mat still shared is not ours to hand out again, nor is a view into a
+    // larger one.
+    if (mat.u && mat.u->refcount == 1 && mat.isContinuous() && mat.datastart == mat.data) {
+        // Only the sizes of the files of the moment are worth keeping
+        constexpr size_t LIMIT = 4;
+        if (idle.size() == LIMIT) idle.erase(idle.begin());
+        idle.push_back(std::move(mat));
+    }
+    mat.release();
+}
@@ -0,0 +1,71 @@
+// scheduler.cxx
+// Copyright (c) 2025, 张子辰
+
+// This file is part of HDR Image Frame.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "scheduler.hxx"
+
+ThreadBudget plan_threads(int threads, std::size_t files) {
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // No more workers than files, as an idle one would only waste its share.
+    int workers = (int)std::clamp<std::size_t>(files, 1, threads);
+    return {workers, std::max(1, threads / workers)};
+}
+
+void apply_thread_budget(const ThreadBudget &budget) {
+    // One thread means no pool at all to OpenCV: its functions then run in the
+    // calling worker, which is what a batch spread over every core wants.
+    //
+    // libultrahdr offers no such setting; it starts a few threads of its own
+    // (at most 4 in v2.0.1) for each encode and decode of an UltraHDR photo,
+    // which stay busy only for a short part of the processing of a file.
+    cv::setNumThreads(budget.intra);
+}
+
+void run_parallel(std::size_t count, int workers, const std::function<void(std::size_t)> &job) {
+    // Run in the calling thread when there is nothing to share, sparing the
+    // thread creation for the common single file.
+    if (workers <= 1 || count <= 1) {
+        for (std::size_t i = 0; i < count; i++) job(i);
+        return;
+    }
+
+    std::atomic<std::size_t> next = 0;
+    auto worker = [&] {
+        for (auto i = next++; i < count; i = next++) job(i);
+    };
+
+    std::vector<std::thread> threads;
+    for (int k = 1; k < workers; k++) threads.emplace_back(worker);
+    worker(); // the calling thread is one of the workers
+    for (auto &thread : threads) thread.join();
+}
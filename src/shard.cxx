@@ -0,0 +1,151 @@
+// shard.cxx
+// Copyright (c) 2025, 张子辰
+
+// This file is part of HDR Image Frame.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <iostream>
+#include <format>
+#include <string>
+#include <map>
+#include <set>
+#include <cstdint>
+
+#include "shard.hxx"
+#include "string.hxx"
+
+using std::string, std::vector, std::cerr, std::endl;
+namespace fs = std::filesystem;
+
+namespace {
+
+// The path an input is known by, in hashes and manifests alike
+string key(const fs::path &input) {
+    return input.lexically_normal().generic_string();
+}
+
+string escape(const string &field) {
+    string escaped;
+    for (char c : field) {
+        if (c == '\t') escaped += "\\t";
+        else if (c == '\n') escaped += "\\n";
+        else if (c == '\\') escaped += "\\\\";
+        else escaped += c;
+    }
+    return escaped;
+}
+
+string unescape(const string &field) {
+    string unescaped;
+    for (size_t i = 0; i < field.size(); i++) {
+        if (field[i] != '\\' || i + 1 == field.size()) { unescaped += field[i]; continue; }
+        auto c = field[++i];
+        unescaped += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+    }
+    return unescaped;
+}
+
+constexpr auto HEADER = "input\toutput\tstatus\tmilliseconds";
+
+struct Entry {
+    string output, status, milliseconds;
+};
+
+}
+
+bool in_shard(const fs::path &input, int index, int count) {
+    return (int)(fnv1a(key(input)) % count) == index - 1;
+}
+
+bool Manifest::open(const fs::path &path) {
+    file.open(path, std::ios::trunc);
+    if (!file) {
+        cerr << "Unable to write the manifest " << path << endl;
+        return false;
+    }
+    file << HEADER << endl;
+    return true;
+}
+
+void Manifest::record(const fs::path &input, const fs::path &output, bool framed, double milliseconds) {
+    // Each line is flushed, for a run cut short to leave the inputs it did
+    auto line = std::format("{}\t{}\t{}\t{:.0f}\n", escape(key(input)), escape(output.string()),
+                            framed ? "ok" : "failed", milliseconds);
+    std::lock_guard lock(mutex);
+    file << line << std::flush;
+}
+
+int merge_manifests(const vector<fs::path> &manifests, const vector<fs::path> &inputs) {
+    std::map<string, Entry> entries;
+    for (auto &manifest : manifests) {
+        std::ifstream file(manifest);
+        string line;
+        if (!file || !std::getline(file, line) || line != HEADER) {
+            cerr << "Unable to read the manifest " << manifest << endl;
+            return 2;
+        }
+        while (std::getline(file, line)) {
+            vector<string> fields;
+            for (size_t start = 0;;) {
+                auto end = line.find('\t', start);
+                fields.push_back(unescape(line.substr(start, end - start)));
+                if (end == string::npos) break;
+                start = end + 1;
+            }
+            // A line cut short by a crash is dropped
+            if (fields.size() != 4) continue;
+            auto &entry = entries[fields[0]];
+            if (entry.status != "ok") entry = {fields[1], fields[2], fields[3]};
+        }
+    }
+
+    // The inputs in the order given, then whatever else the manifests hold
+    vector<string> order;
+    std::set<string> expected;
+    for (auto &input : inputs)
+        if (expected.insert(key(input)).second) order.push_back(key(input));
+    for (auto &[input, entry] : entries)
+        if (!expected.contains(input)) order.push_back(input);
+
+    std::cout << HEADER << '\n';
+    int framed = 0, failed = 0, missing = 0;
+    for (auto &input : order) {
+        auto it = entries.find(input);
+        if (it == entries.end()) {
+            cerr << "Missing: " << input << endl;
+            missing++;
+            continue;
+        }
+        auto &entry = it->second;
+        std::cout << escape(input) << '\t' << escape(entry.output) << '\t' << entry.status << '\t'
+                  << entry.milliseconds << '\n';
+        if (entry.status == "ok") framed++;
+        else {
+            cerr << "Failed: " << input << endl;
+            failed++;
+        }
+    }
+    std::cout << std::flush;
+    cerr << std::format("{} framed, {} failed, {} missing", framed, failed, missing) << endl;
+    return failed || missing ? 1 : 0;
+}
@@ -15,6 +15,32 @@ std::optional<std::chrono::sys_seconds> parse_datetime(const std::string &dateti
     return sys_days(date) + hours{h} + minutes{mi} + seconds{s};
 }
 
+std::string json_string(const std::string &text) {
+    std::string quoted = "\"";
+    for (unsigned char c : text) {
+        if (c == '"') quoted += "\\\"";
+        else if (c == '\\') quoted += "\\\\";
+        else if (c == '\n') quoted += "\\n";
+        else if (c == '\t') quoted += "\\t";
+        else if (c < 0x20) {
+            char escaped[7];
+            snprintf(escaped, sizeof escaped, "\\u%04x", c);
+            quoted += escaped;
+        } else quoted += c;
+    }
+    quoted += '"';
+    return quoted;
+}
+
+uint64_t fnv1a(std::string_view data) {
+    uint64_t hash = 14695981039346656037u;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
 char32_t utf8_iterator::operator*() const {
     if (m_it == m_end) return 0;
 
@@ -51,7 +51,15 @@ void TextRenderer::render(cv::Mat& img, const string& text, cv::Point pos, cv::S
                     if (alpha > 0) {
                         // Handle Multi-channel generic
                         auto channels = img.channels();
-                        if (img.depth() == CV_8U) {
+                        if (img.depth() == CV_8U && channels == 4) {
+                            // Straight alpha: the text goes over what is there
+                            cv::Vec4b& pixel = img.at<cv::Vec4b>(y, x);
+                            double below = pixel[3] / 255.0 * (1.0 - alpha);
+                            double coverage = alpha + below;
+                            for (int i = 0; i < 3; i++)
+                                pixel[i] = cv::saturate_cast<uchar>((color[i] * alpha + pixel[i] * below) / coverage);
+                            pixel[3] = cv::saturate_cast<uchar>(coverage * 255);
+                        } else if (img.depth() == CV_8U) {
                             cv::Vec3b& pixel = img.at<cv::Vec3b>(y, x);
                             for (int i = 0; i < 3; i++)
                                 pixel[i] = (uchar)(pixel[i] * (1.0 - alpha) + color[i] * alpha);
@@ -0,0 +1,130 @@
+// watch.cxx
+// Copyright (c) 2025, 张子辰
+
+// This file is part of HDR Image Frame.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "watch.hxx"
+
+using std::cerr, std::endl, std::string;
+namespace fs = std::filesystem;
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+// How long a file has to be left alone after it was last written to
+constexpr auto SETTLE_TIME = std::chrono::milliseconds(150);
+
+// Whether `name` is that of a photo, rather than, say, the hidden temporary
+// file a photo is written to before being moved in place
+bool isPhoto(const fs::path &name) {
+    auto extension = name.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), tolower);
+    return !name.filename().string().starts_with('.') && (extension == ".jpg" || extension == ".jpeg");
+}
+
+// Whether `file` ends with the EOI marker of a JPEG, as it does only once it is
+// written in full
+bool isComplete(const fs::path &file) {
+    std::ifstream in(file, std::ios::binary | std::ios::ate);
+    if (!in.good() || in.tellg() < 4) return false;
+    char end[2];
+    in.seekg(-2, std::ios::end);
+    in.read(end, 2);
+    return in.good() && (uint8_t)end[0] == 0xFF && (uint8_t)end[1] == 0xD9;
+}
+
+}
+
+int watch_directory(const fs::path &dir, const std::function<void(const fs::path&)> &arrived) {
+    auto fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        cerr << "Unable to watch " << dir << ": " << strerror(errno) << endl;
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    // Photos written to, not yet framed, with the last time they were
+    std::map<fs::path, clock_type::time_point> settling;
+    for (;;) {
+        // Sleep until an event comes, or until the next photo settles.
+        int timeout = -1;
+        if (!settling.empty()) {
+            auto next = std::min_element(settling.begin(), settling.end(),
+                [](const auto &a, const auto &b) { return a.second < b.second; })->second + SETTLE_TIME;
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(next - clock_type::now()).count();
+            timeout = std::max<long long>(wait, 0);
+        }
+
+        pollfd poller = {fd, POLLIN, 0};
+        auto ready = poll(&poller, 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            cerr << "Unable to watch " << dir << ": " << strerror(errno) << endl;
+            close(fd);
+            return 1;
+        }
+
+        if (ready > 0) {
+            alignas(inotify_event) char events[64 * (sizeof(inotify_event) + NAME_MAX + 1)];
+            auto length = read(fd, events, sizeof events);
+            for (ssize_t pos = 0; pos < length; ) {
+                auto event = reinterpret_cast<const inotify_event*>(events + pos);
+                pos += sizeof(inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW)
+                    cerr << "Too many photos arrived at once in " << dir << ", some may be missed" << endl;
+                if (event->mask & IN_IGNORED) { // the directory is gone
+                    cerr << "Stopped watching " << dir << ", which was removed" << endl;
+                    close(fd);
+                    return 1;
+                }
+                if (event->len && !(event->mask & IN_ISDIR) && isPhoto(event->name))
+                    settling[dir / event->name] = clock_type::now();
+            }
+        }
+
+        // Frame the photos which have settled
+        auto now = clock_type::now();
+        for (auto it = settling.begin(); it != settling.end(); ) {
+            if (now - it->second < SETTLE_TIME) { ++it; continue; }
+            auto photo = it->first;
+            it = settling.erase(it);
+            // A photo still being written is seen again when next closed
+            if (isComplete(photo)) arrived(photo);
+        }
+    }
+}